@@ -0,0 +1,137 @@
+/*
+ *
+ * Copyright (c) 2021, Brett Cameron
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * 
+ */
+
+/*
+ * Frame capture and replay for the server, in the same format as
+ * RabbitMQ_capture() (the encoding and the feeding are shared with it, in
+ * ../rmq/rmqcap.c). replay_open() returns one end of a socketpair with a thread
+ * writing a capture file into the other end (and discarding whatever the server
+ * writes back), so that the recorded traffic goes through the normal receive
+ * path at memory speed, without a broker.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include "rmq.h"
+#include "rmqcap.h"
+#include "capture.h"
+
+#define MAX_FRAME 131072	/* As negotiated by the server */
+
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    int loops;
+} feed_t;
+
+
+FILE *capture_open(const char *file)
+{
+    return (rmq_capture_open(file));
+}
+
+
+/* Methods and properties arrive decoded, so they are re-encoded here */
+int capture_frame(FILE * fp, amqp_frame_t * frame)
+{
+    static unsigned char buf[MAX_FRAME + 8];
+    int len;
+
+    if ((len = rmq_frame_encode(buf, MAX_FRAME, frame)) <= 0) {
+	return (len);		/* Heartbeats are not recorded */
+    }
+
+    return (fwrite(buf, 1, len, fp) == (size_t) len ? 0 : -1);
+}
+
+
+static void *feed(void *arg)
+{
+    feed_t *fp = (feed_t *) arg;
+    int i;
+
+    for (i = 0; fp->loops < 1 || i < fp->loops; i++) {
+	if (rmq_feed_write(fp->fd, fp->data, fp->len) == -1) {
+	    break;
+	}
+    }
+
+    rmq_feed_end(fp->fd);
+    free(fp->data);
+    free(fp);
+    return (NULL);
+}
+
+
+/*
+ * Returns a socket from which the frames in "file" can be read "loops" times
+ * over (indefinitely if loops is less than 1), followed by end of file. All
+ * frames are moved onto channel 1. Returns -1 (with errno set) on error.
+ */
+int replay_open(const char *file, int loops)
+{
+    pthread_t tid;
+    feed_t *fp;
+    char *data;
+    size_t len;
+    int sv[2];
+
+    if ((data = rmq_capture_load(file, &len)) == NULL) {
+	return (-1);
+    }
+
+    if ((fp = (feed_t *) calloc(1, sizeof(feed_t))) == NULL) {
+	free(data);
+	errno = ENOMEM;
+	return (-1);
+    }
+
+    fp->data = data;
+    fp->len = len;
+    fp->loops = loops;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+	free(fp->data);
+	free(fp);
+	return (-1);
+    }
+
+    fp->fd = sv[1];
+
+    if ((errno = pthread_create(&tid, NULL, feed, fp)) != 0) {
+	close(sv[0]);
+	close(sv[1]);
+	free(fp->data);
+	free(fp);
+	return (-1);
+    }
+
+    pthread_detach(tid);
+    return (sv[0]);
+}
@@ -0,0 +1,35 @@
+/*
+ *
+ * Copyright (c) 2021, Brett Cameron
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * 
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+/* Same format as RabbitMQ_capture() in ../rmq (see rmqcap.c there) */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern FILE *capture_open(const char *);
+    extern int capture_frame(FILE *, amqp_frame_t *);
+    extern int replay_open(const char *, int);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -21,6 +21,8 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
 #include <errno.h>
 #include <dlfcn.h>
 #include <unistd.h>
@@ -32,6 +34,7 @@
 #include "utils.h"
 #include "list.h"
 #include "hash.h"
+#include "capture.h"
 
 
 #define SVRINIT "AMQP_SVRINIT"
@@ -53,6 +56,7 @@ typedef struct {
     adc_HT_t *ht;
     int (*init) (int, char **);
     int (*done) ();
+    int binds;			/* Bindings sent at startup */
 } gbl_t;
 
 
@@ -86,6 +90,22 @@ typedef enum {			/* Really only using INFO and FATAL for the moment */
 static int debug = 0;
 static int trace = 0;
 
+/* Acknowledgement coalescing (-a) */
+static int ack_batch = 0;	/* Acks per multiple=1 ack (0 = ack each message) */
+static int ack_msec = 0;	/* Longest an ack is held back */
+static int ack_pending = 0;
+static uint64_t ack_tag = 0;
+static uint64_t ack_due = 0;
+
+/* Heartbeats (-H); times in microseconds */
+static uint64_t heartbeat = 0;	/* Negotiated interval (0 = off) */
+static uint64_t hb_recv = 0;	/* When the socket last had something for us */
+static uint64_t hb_send = 0;	/* When our next heartbeat falls due */
+
+/* Frame capture (-C) and replay (-R) */
+static FILE *capture = NULL;
+static int replaying = 0;
+
 
 #define OKAY(x) ((x).reply_type == AMQP_RESPONSE_NORMAL)
 
@@ -278,22 +298,37 @@ static void addkey(adc_HT_t * ht, const char *str)
 }
 
 
+/* Bindings are sent with nowait; main() checks them all with one round trip */
 static void bindkey(const void *ent, void *ud)
 {
     info_t *tmp = (info_t *) ent;
-    amqp_rpc_reply_t rh;
+    amqp_queue_bind_t m;
     gbl_t *gbl = (gbl_t *) ud;
+    int rv;
 
-    amqp_queue_bind(gbl->conn, 1, amqp_cstring_bytes(gbl->queue),
-		    amqp_cstring_bytes(gbl->exchange),
-		    amqp_cstring_bytes(tmp->routing_key),
-		    amqp_empty_table);
-
-    rh = amqp_get_rpc_reply(gbl->conn);
+    memset(&m, '\0', sizeof(m));
+    m.queue = amqp_cstring_bytes(gbl->queue);
+    m.exchange = amqp_cstring_bytes(gbl->exchange);
+    m.routing_key = amqp_cstring_bytes(tmp->routing_key);
+    m.nowait = 1;
+    m.arguments = amqp_empty_table;
 
-    if (!OKAY(rh)) {
-	ulog(FATAL, getmsg(rh, "Unable to create binding"));
+    if ((rv = amqp_send_method(gbl->conn, 1, AMQP_QUEUE_BIND_METHOD, &m)) < 0) {
+	ulog(FATAL, "Unable to create binding: %s", amqp_error_string(-rv));
     }
+
+    gbl->binds++;
+}
+
+
+/* Milliseconds since *t, which is moved on to now */
+static double lap(uint64_t * t)
+{
+    uint64_t now = now_microseconds();
+    double ms = (now - *t) / 1e3;
+
+    *t = now;
+    return (ms);
 }
 
 
@@ -342,8 +377,168 @@ static int load(adc_HT_t * ht, const char *file)
 }
 
 
-static void dequeue(amqp_connection_state_t conn, svcinfo_t * data,
-		    amqp_bytes_t * rep, amqp_bytes_t * cid, uint64_t * tag)
+/* Messages are processed in order on a single channel, so everything up to
+   the last tag has always been completed and one multiple=1 ack covers it */
+static void ack_flush(amqp_connection_state_t conn)
+{
+    int rv;
+
+    if (ack_pending != 0) {
+	if ((rv = amqp_basic_ack(conn, 1, ack_tag, 1)) < 0) {
+	    ulog(FATAL, "Failed to acknowledge messages: %s",
+		 amqp_error_string(-rv));
+	}
+
+	ack_pending = 0;
+    }
+}
+
+
+static void ack(amqp_connection_state_t conn, uint64_t tag)
+{
+    int rv;
+
+    if (ack_batch == 0) {
+	if ((rv = amqp_basic_ack(conn, 1, tag, 0)) < 0) {
+	    ulog(FATAL, "Failed to acknowledge message: %s",
+		 amqp_error_string(-rv));
+	}
+
+	return;
+    }
+
+    ack_tag = tag;
+
+    if (ack_pending++ == 0) {
+	ack_due = now_microseconds() + (uint64_t) ack_msec * 1000;
+    }
+
+    if (ack_pending >= ack_batch || now_microseconds() >= ack_due) {
+	ack_flush(conn);
+    }
+}
+
+
+/*
+ * Waits for the next frame, sending any held back acks when they fall due (if
+ * "idle") and keeping the heartbeat timers: one goes out every half interval,
+ * and two intervals without anything arriving is a dead connection. The library
+ * swallows the broker's heartbeats, so the socket itself is watched for those.
+ */
+static int wait_frame(amqp_connection_state_t conn, amqp_frame_t * fp,
+		      int idle)
+{
+    struct timeval tv;
+    amqp_frame_t hb;
+    fd_set rfds;
+    uint64_t now;
+    uint64_t due;
+    int fd;
+    int rv;
+
+    while (1) {
+	now = now_microseconds();
+	due = 0;
+
+	if (idle && ack_pending != 0) {
+	    if (now >= ack_due) {
+		ack_flush(conn);
+	    } else {
+		due = ack_due;
+	    }
+	}
+
+	if (heartbeat != 0) {
+	    if (now >= hb_send) {
+		memset(&hb, '\0', sizeof(hb));
+		hb.frame_type = AMQP_FRAME_HEARTBEAT;
+		hb.channel = 0;
+
+		if ((rv = amqp_send_frame(conn, &hb)) < 0) {
+		    return (rv);
+		}
+
+		hb_send = now + heartbeat / 2;
+	    }
+
+	    if (due == 0 || hb_send < due) {
+		due = hb_send;
+	    }
+
+	    if (hb_recv + 2 * heartbeat < due) {
+		due = hb_recv + 2 * heartbeat;
+	    }
+
+	    if (!amqp_frames_enqueued(conn) && !amqp_data_in_buffer(conn)) {
+		fd = amqp_get_sockfd(conn);
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		tv.tv_sec = (due > now ? due - now : 0) / 1000000;
+		tv.tv_usec = (due > now ? due - now : 0) % 1000000;
+
+		if ((rv = select(fd + 1, &rfds, NULL, NULL, &tv)) < 0) {
+		    if (errno == EINTR) {
+			continue;
+		    }
+
+		    return (AMQP_STATUS_SOCKET_ERROR);
+		}
+
+		if (rv == 0) {
+		    if (now_microseconds() >= hb_recv + 2 * heartbeat) {
+			return (AMQP_STATUS_HEARTBEAT_TIMEOUT);
+		    }
+
+		    continue;
+		}
+
+		hb_recv = now = now_microseconds();
+	    }
+	}
+
+	if (due == 0) {
+	    rv = amqp_simple_wait_frame(conn, fp);
+	} else {
+	    tv.tv_sec = (due > now ? due - now : 0) / 1000000;
+	    tv.tv_usec = (due > now ? due - now : 0) % 1000000;
+
+	    if ((rv = amqp_simple_wait_frame_noblock(conn, fp, &tv))
+		== AMQP_STATUS_TIMEOUT) {
+		continue;	/* Something (perhaps only a heartbeat) fell due */
+	    }
+	}
+
+	if (rv == AMQP_STATUS_OK && heartbeat != 0) {
+	    hb_recv = now_microseconds();
+	}
+
+	return (rv);
+    }
+}
+
+
+/* Reads the next frame (via wait_frame()), recording it if capturing */
+static int read_frame(amqp_connection_state_t conn, amqp_frame_t * fp,
+		      int idle)
+{
+    int rv;
+
+    rv = (idle || heartbeat != 0 ? wait_frame(conn, fp, idle)
+	  : amqp_simple_wait_frame(conn, fp));
+
+    if (rv >= 0 && capture != NULL && capture_frame(capture, fp) == -1) {
+	ulog(WARN, "Unable to write capture file; capture stopped");
+	fclose(capture);
+	capture = NULL;
+    }
+
+    return (rv);
+}
+
+
+/* Returns -1 at the end of a replay, otherwise 0 */
+static int dequeue(amqp_connection_state_t conn, svcinfo_t * data,
+		   amqp_bytes_t * rep, amqp_bytes_t * cid, uint64_t * tag)
 {
     char *tmp;
     int total_size;
@@ -363,7 +558,11 @@ static void dequeue(amqp_connection_state_t conn, svcinfo_t * data,
   loop:
     amqp_maybe_release_buffers(conn);
 
-    if ((rv = amqp_simple_wait_frame(conn, fp)) < 0) {
+    if ((rv = read_frame(conn, fp, 1)) < 0) {
+	if (replaying) {
+	    return (-1);
+	}
+
 	ulog(FATAL, "Error receiving frame: %s", amqp_error_string(-rv));
     }
 
@@ -393,7 +592,7 @@ static void dequeue(amqp_connection_state_t conn, svcinfo_t * data,
     data->key_len = dp->routing_key.len;
     memcpy(data->routing_key, dp->routing_key.bytes, dp->routing_key.len);
 
-    if ((rv = amqp_simple_wait_frame(conn, fp)) < 0) {
+    if ((rv = read_frame(conn, fp, 0)) < 0) {
 	ulog(FATAL, "Error receiving frame: %s", amqp_error_string(-rv));
     }
 
@@ -452,7 +651,7 @@ static void dequeue(amqp_connection_state_t conn, svcinfo_t * data,
     total_read = 0;
 
     while (total_read < total_size) {
-	if ((rv = amqp_simple_wait_frame(conn, fp)) < 0) {
+	if ((rv = read_frame(conn, fp, 0)) < 0) {
 	    ulog(FATAL, "Error receiving frame: %s",
 		 amqp_error_string(-rv));
 	}
@@ -479,15 +678,11 @@ static void dequeue(amqp_connection_state_t conn, svcinfo_t * data,
     if (tag != NULL) {
 	*tag = dp->delivery_tag;
     } else {
-	if ((rv =
-	     amqp_basic_ack(conn, ((amqp_frame_t *) fp)->channel,
-			    dp->delivery_tag, 0)) < 0) {
-	    ulog(FATAL, "Failed to acknowledge message: %s",
-		 amqp_error_string(-rv));
-	}
+	ack(conn, dp->delivery_tag);
     }
 
     data->idata.len = total_size;
+    return (0);
 }
 
 
@@ -501,8 +696,13 @@ static int serve(gbl_t * gbl)
     amqp_bytes_t cid_dsc;
     amqp_bytes_t rep_dsc;
     svcinfo_t data;
+    long count = 0;
+    uint64_t start;
+    double secs;
     int rv;
 
+    start = now_microseconds();
+
     while (1) {
 	memset(&props, '\0', sizeof(props));
 
@@ -514,7 +714,11 @@ static int serve(gbl_t * gbl)
 	rep_dsc.bytes = rep;
 	rep_dsc.len = sizeof(rep);
 
-	dequeue(gbl->conn, &data, &rep_dsc, &cid_dsc, &tag);
+	if (dequeue(gbl->conn, &data, &rep_dsc, &cid_dsc, &tag) == -1) {
+	    break;		/* End of replay */
+	}
+
+	count++;
 
 	if (debug) {
 	    ulog(INFO, "Message received:\n"
@@ -575,15 +779,9 @@ static int serve(gbl_t * gbl)
 		     amqp_error_string(-rv));
 	    }
 
-	    if ((rv = amqp_basic_ack(gbl->conn, 1, tag, 0)) < 0) {
-		ulog(FATAL, "Failed to acknowledge message: %s",
-		     amqp_error_string(-rv));
-	    }
+	    ack(gbl->conn, tag);
 	} else {
-	    if ((rv = amqp_basic_ack(gbl->conn, 1, tag, 0)) < 0) {
-		ulog(FATAL, "Failed to acknowledge message: %s",
-		     amqp_error_string(-rv));
-	    }
+	    ack(gbl->conn, tag);
 
 	    if (debug) {
 		ulog(INFO, "No reply queue specified (okay)");
@@ -599,8 +797,11 @@ static int serve(gbl_t * gbl)
 	}
     }
 
-    /* Never get here. We possibly need some way of being signalled to break out of the
+    /* Only a replay gets here. We possibly need some way of being signalled to break out of the
        above loop and return - TBD */
+    secs = (now_microseconds() - start) / 1e6;
+    ulog(INFO, "Replayed %ld messages in %.3f seconds (%.0f/sec)", count,
+	 secs, secs > 0 ? count / secs : 0.0);
     return (0);
 }
 
@@ -640,6 +841,10 @@ static void usage(const char *path, const char *fmt, ...)
 	    "\t-l filename           Shared library\n"
 	    "\t-q queue              Queue name\n"
 	    "\t-n count              Prefetch count\n"
+	    "\t-a count[:msec]       Acknowledge in batches of count (or every msec, default 100)\n"
+	    "\t-H seconds            Negotiate heartbeats (default 0, off)\n"
+	    "\t-C filename           Record received frames to a capture file\n"
+	    "\t-R filename[:loops]   Replay a capture file (loops times) instead of connecting\n"
 	    "\t-D                    Don't declare queue or create bindings\n"
 	    "\t-d                    Enable debug-level logging\n"
 	    "\t-t                    Enable trace-level logging\n"
@@ -670,6 +875,13 @@ int main(int argc, char **argv)
     char *user = DEF_USER;
     char *password = DEF_PASSWORD;
     char *shlib = NULL;
+    char *capture_file = NULL;
+    char *replay_file = NULL;
+    int loops = 1;
+    int hb_secs = 0;
+    uint64_t start;
+    uint64_t t;
+    double ms[5];
 
     gbl_t gbl = {
 	0,
@@ -677,7 +889,8 @@ int main(int argc, char **argv)
 	NULL,
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	0
     };
 
 
@@ -685,7 +898,7 @@ int main(int argc, char **argv)
 
     n = 0;
 
-    while ((c = getopt(argc, argv, "o:s:U:P:h:p:v:e:l:q:n:dtD")) != EOF) {
+    while ((c = getopt(argc, argv, "o:s:U:P:h:p:v:e:l:q:n:a:H:C:R:dtD")) != EOF) {
 	switch (c) {
 	case 's':
 	    if (optarg[0] == '@') {
@@ -749,6 +962,32 @@ int main(int argc, char **argv)
 	    prefetch = atoi(optarg);
 	    break;
 
+	case 'a':
+	    ack_batch = atoi(optarg);
+	    ack_msec =
+		(strchr(optarg, ':') ? atoi(strchr(optarg, ':') + 1) : 100);
+	    ack_batch = (ack_batch > 1 ? ack_batch : 0);
+	    break;
+
+	case 'H':
+	    hb_secs = atoi(optarg);
+	    break;
+
+	case 'C':
+	    capture_file = optarg;
+	    break;
+
+	case 'R':
+	    replay_file = optarg;
+
+	    if (strchr(optarg, ':') != NULL) {
+		loops = atoi(strchr(optarg, ':') + 1);
+		*strchr(optarg, ':') = '\0';
+	    }
+
+	    replaying = 1;
+	    break;
+
 	default:
 	    usage(argv[0], "Invalid command line option (-%c)\n", optopt);
 	    break;
@@ -768,11 +1007,11 @@ int main(int argc, char **argv)
 	usage(argv[0], "No shared library specified\n");
     }
 
-    if (gbl.queue == NULL) {
+    if (gbl.queue == NULL && !replaying) {
 	usage(argv[0], "No queue name specified\n");
     }
 
-    if (host == NULL) {
+    if (host == NULL && !replaying) {
 	if (gethostname(tmp, sizeof(tmp) - 1) == -1) {
 	    ulog(FATAL, "gethostname(): %s", strerror(errno));
 	}
@@ -811,20 +1050,59 @@ int main(int argc, char **argv)
 	ulog(FATAL, "Unable to allocate connection handle");
     }
 
+    if (replaying) {
+	if ((fd = replay_open(replay_file, loops)) < 0) {
+	    ulog(FATAL, "Unable to replay %s: %s", replay_file,
+		 strerror(errno));
+	}
+
+	amqp_set_sockfd(gbl.conn, fd);
+
+	/* There is no login, so set what it would have negotiated */
+	amqp_tune_connection(gbl.conn, 0, 131072, 0);
+
+	if (serve(&gbl) != 0) {
+	    ulog(INFO,
+		 "Error status returned by user routine; server shutting down");
+	}
+
+	amqp_destroy_connection(gbl.conn);
+
+	if (ip != NULL) {
+	    dlclose(ip);
+	}
+
+	return (0);
+    }
+
+    memset(ms, '\0', sizeof(ms));
+    start = t = now_microseconds();
+
     if ((fd = amqp_open_socket(host, port)) < 0) {
 	ulog(FATAL, "Error opening socket: %s", amqp_error_string(-fd));
     }
 
+    ms[0] = lap(&t);
 
     amqp_set_sockfd(gbl.conn, fd);
 
-    rh = amqp_login(gbl.conn, vhost, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN,
-		    user, password);
+    rh = amqp_login(gbl.conn, vhost, 0, 131072, hb_secs,
+		    AMQP_SASL_METHOD_PLAIN, user, password);
 
     if (!OKAY(rh)) {
 	ulog(FATAL, getmsg(rh, "Error logging in to broker"));
     }
 
+    /* The broker may have asked for something shorter */
+    heartbeat = (uint64_t) amqp_get_heartbeat(gbl.conn) * 1000000;
+    hb_recv = now_microseconds();
+    hb_send = hb_recv + heartbeat / 2;
+
+    if (heartbeat != 0 && debug) {
+	ulog(INFO, "Heartbeat every %d seconds",
+	     amqp_get_heartbeat(gbl.conn));
+    }
+
 
     amqp_channel_open(gbl.conn, 1);
 
@@ -834,6 +1112,7 @@ int main(int argc, char **argv)
 	ulog(FATAL, getmsg(rh, "Error opening channel"));
     }
 
+    ms[1] = lap(&t);
 
     if (declare) {
 	/* Declare queue */
@@ -846,8 +1125,28 @@ int main(int argc, char **argv)
 	    ulog(FATAL, getmsg(rh, "Error declaring queue"));
 	}
 
-	/* Bind all routing keys to queue */
+	ms[2] = lap(&t);
+
+	/*
+	 * Bind all routing keys to queue. All are sent every time, as there is
+	 * no asking the broker which it already has; with nowait, one that is
+	 * already there costs next to nothing.
+	 */
 	adc_HT_Traverse(gbl.ht, bindkey, &gbl);
+
+	if (gbl.binds != 0) {
+	    /* A failed bind closes the channel, and so fails this */
+	    amqp_queue_declare(gbl.conn, 1, amqp_cstring_bytes(gbl.queue),
+			       1, 0, 0, 0, amqp_empty_table);
+
+	    rh = amqp_get_rpc_reply(gbl.conn);
+
+	    if (!OKAY(rh)) {
+		ulog(FATAL, getmsg(rh, "Unable to create bindings"));
+	    }
+	}
+
+	ms[3] = lap(&t);
     }
 
     /* Set prefetch count if non-zero */
@@ -874,6 +1173,19 @@ int main(int argc, char **argv)
 	ulog(FATAL, getmsg(rh, "Unable to consume from queue"));
     }
 
+    ms[4] = lap(&t);
+
+    ulog(INFO,
+	 "Started in %.1f ms (connect %.1f, login %.1f, declare %.1f, bind %.1f, consume %.1f); %d bindings",
+	 (t - start) / 1e3, ms[0], ms[1], ms[2], ms[3], ms[4], gbl.binds);
+
+    if (capture_file != NULL) {
+	if ((capture = capture_open(capture_file)) == NULL) {
+	    ulog(FATAL, "Unable to create capture file %s: %s",
+		 capture_file, strerror(errno));
+	}
+    }
+
 
     /* Start processing requests... */
     if (serve(&gbl) != 0) {
@@ -881,6 +1193,12 @@ int main(int argc, char **argv)
 	     "Error status returned by user routine; server shutting down");
     }
 
+    ack_flush(gbl.conn);
+
+    if (capture != NULL) {
+	fclose(capture);
+    }
+
     rh = amqp_channel_close(gbl.conn, 1, AMQP_REPLY_SUCCESS);
 
     if (!OKAY(rh)) {
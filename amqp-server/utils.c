@@ -40,6 +40,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/time.h>
 
 #include <stdint.h>
 #include <amqp.h>
@@ -186,3 +187,11 @@ void amqp_dump(void const *buffer, size_t len)
     if (numinrow != 0)
 	fprintf(stderr, "%08lX:\n", count);
 }
+
+uint64_t now_microseconds(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #endif
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "amqp.h"
 #ifdef __VMS
@@ -36,9 +37,92 @@
 #define RMQ_Q_NAM_LEN 128
 #endif
 
+#ifndef RMQ_REPLY_TO
+#define RMQ_REPLY_TO "amq.rabbitmq.reply-to"	/* Direct reply-to pseudo-queue */
+#endif
+
+#define RMQ_CAPTURE_MAGIC "RMQCAP01"	/* Start of a RabbitMQ_capture() file */
+
+#ifndef RMQ_CONFIRM_RING
+#define RMQ_CONFIRM_RING 4096	/* Default maximum number of unconfirmed publishes */
+#endif
+
+/* Per-connection message arena (see RabbitMQ_dequeue_view()) */
+typedef struct {
+    char *base;
+    size_t size;		/* Grows to the high-water mark */
+    size_t used;
+    size_t want;		/* Space needed by the current message */
+    void *extra;		/* Overflow blocks, freed at the next reset */
+    long long messages;		/* Messages received */
+    long long mallocs;		/* Heap allocations made receiving them */
+} RMQ_arena_t;
+
+typedef struct {
+    long long messages;
+    long long mallocs;
+    size_t size;
+} RMQ_arena_stats_t;
+
+/* Publisher confirm tracking (see RabbitMQ_confirm_select()) */
+typedef struct {
+    int size;			/* Ring size (0 until confirms are selected) */
+    unsigned char *ring;	/* State of each outstanding sequence number */
+    uint64_t next;		/* Sequence number of the next publish */
+    uint64_t oldest;		/* Oldest unconfirmed sequence number */
+    long long acks;
+    long long nacks;
+    int nacked;			/* Nacks since the last RabbitMQ_confirm_wait() */
+    uint64_t end;		/* See RabbitMQ_confirm_deadline() (0 for none) */
+    void (*func) (uint64_t, int, void *);	/* Optional per-message callback */
+    void *ud;
+} RMQ_confirm_t;
+
+struct RMQ_shared_;		/* Connection state shared by all channel handles */
+struct RMQ_failover_;		/* Standby connection and topology (see RabbitMQ_failover()) */
+typedef struct RMQ_rpc_ RMQ_rpc_t;	/* Outstanding RPC (see RabbitMQ_rpc_send()) */
+
+/* Acknowledgement coalescing (see RabbitMQ_ack_batch()) */
+typedef struct {
+    int batch;			/* Acks per multiple=1 ack (0 when off) */
+    int interval;		/* Longest an ack is held back (msec) */
+    unsigned char *done;	/* State of each tag above "acked" */
+    int size;
+    uint64_t acked;		/* Everything up to here has been acknowledged */
+    uint64_t high;		/* Everything up to here has completed */
+    int pending;		/* Completed but not yet acknowledged */
+    int ready;			/* How many of those are up to "high" */
+    uint64_t due;		/* When those must be sent (usec), or 0 */
+} RMQ_acker_t;
+
+#define RMQ_HIST_BUCKETS 304	/* 8 per power of two up to 2^40 */
+
+/* Log-bucketed latency histogram, in microseconds (see RabbitMQ_stats()) */
+typedef struct {
+    long long count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    long long buckets[RMQ_HIST_BUCKETS];
+} RMQ_hist_t;
+
+typedef struct {
+    long long publishes;
+    long long publish_bytes;
+    long long deliveries;	/* Messages received (get or consume) */
+    long long delivery_bytes;
+    long long frames;		/* Frames received */
+    long long acks;		/* basic.ack frames sent */
+    long long rpcs;		/* RPC requests sent */
+    RMQ_hist_t rpc;		/* RPC round trip */
+    RMQ_hist_t wait;		/* Time spent waiting for each frame */
+    long long failovers;	/* Switches to another connection (see RabbitMQ_failover()) */
+    uint64_t failover_usec;	/* How long the last one took */
+} RMQ_stats_t;
+
 typedef struct {
     amqp_connection_state_t conn;
-    int chan;			/* Will always be 1 (for the moment) */
+    int chan;			/* 1 for the connection, else see RabbitMQ_channel_open() */
     int fd;
     char errstr[128];
     struct {
@@ -46,7 +130,34 @@ typedef struct {
 	amqp_bytes_t repq;
 	amqp_basic_properties_t *ph;
 	long long count;
+	RMQ_rpc_t **tab;	/* Outstanding requests, by correlation ID */
+	int size;
+	int used;
+	long long stale;	/* Replies that matched no request */
+	int direct;		/* Use direct reply-to (see RabbitMQ_rpc_direct()) */
     } rpc;
+    RMQ_arena_t arena;
+    RMQ_confirm_t confirm;
+    RMQ_acker_t ack;
+    RMQ_stats_t stats;
+    struct RMQ_shared_ *sh;
+    int owner;			/* Set for the handle returned by RabbitMQ_connect() */
+    FILE *cap;			/* Frame capture (see RabbitMQ_capture()) */
+    unsigned char *capbuf;
+    int replay;			/* Set for RabbitMQ_replay() handles */
+    int parked;			/* Only take frames already parked (see RabbitMQ_loop_run()) */
+    struct RMQ_failover_ *fo;
+    unsigned int epoch;		/* Failovers so far (carried in delivery tags) */
+    int pipeline;		/* Declares don't wait (see RabbitMQ_pipeline()) */
+    int pipelined;		/* Sent since the last RabbitMQ_sync() */
+    int cache;			/* Skip declares already done (see RabbitMQ_topology_cache()) */
+    struct RMQ_cache_ *held;	/* Cache entries waiting on RabbitMQ_sync() */
+    struct {
+	int (*func) (const char *, size_t, void *);
+	void *ud;
+    } sink;			/* Where streamed bodies go (see RabbitMQ_dequeue_stream()) */
+    struct RMQ_spool_ *spool;	/* See RabbitMQ_spool() */
+    void *cvt;			/* Conversion profile, owned by the COBOL bindings (see RMQ_PROFILE) */
 } RMQ_conn_t;
 
 
@@ -56,8 +167,15 @@ typedef struct {
     uint64_t dtag;
     char *cid;
     amqp_bytes_t data;
+    int flags;
 } RMQ_info_t;
 
+/* RMQ_info_t flags */
+#define RMQ_INFO_BORROWED	0x0001	/* data.bytes is not owned (not freed by RabbitMQ_info_init) */
+#define RMQ_INFO_TRUNCATED	0x0002	/* Body did not fit the caller's buffer; data.len is the full size */
+#define RMQ_INFO_ARENA		0x0004	/* rkey, repq and cid belong to the connection arena */
+#define RMQ_INFO_STREAMED	0x0008	/* Body went to the sink; data.bytes is NULL */
+
 
 
 #ifdef __cplusplus
@@ -67,8 +185,22 @@ extern "C" {
     extern char *RabbitMQ_strerror(RMQ_conn_t *);
     extern RMQ_conn_t *RabbitMQ_connect(char *);
     extern void RabbitMQ_disconnect(RMQ_conn_t *);
+    extern RMQ_conn_t *RabbitMQ_channel_open(RMQ_conn_t *);
+    extern void RabbitMQ_channel_close(RMQ_conn_t *);
     extern int RabbitMQ_publish(RMQ_conn_t *, char *, char *, int, int,
 				amqp_basic_properties_t *, char *, int);
+    extern int RabbitMQ_publish_bytes(RMQ_conn_t *, amqp_bytes_t,
+				      amqp_bytes_t, int, int,
+				      amqp_basic_properties_t *,
+				      amqp_bytes_t);
+    extern int RabbitMQ_publish_stream(RMQ_conn_t *, char *, char *, int,
+				       int, amqp_basic_properties_t *,
+				       size_t, int (*)(char *, size_t,
+						       void *), void *);
+    extern int RabbitMQ_publish_table(RMQ_conn_t *, amqp_bytes_t,
+				      amqp_bytes_t, int, int,
+				      amqp_basic_properties_t *, char *,
+				      size_t, int);
     extern char *RabbitMQ_declare_queue(RMQ_conn_t *, char *, int, int,
 					int, int, amqp_table_t *);
     extern int RabbitMQ_declare_exchange(RMQ_conn_t *, char *, char *, int,
@@ -81,6 +213,18 @@ extern "C" {
 				  int, amqp_table_t *);
     extern int RabbitMQ_dequeue(RMQ_conn_t *, RMQ_info_t *, uint64_t *,
 				int);
+    extern int RabbitMQ_dequeue_view(RMQ_conn_t *, RMQ_info_t *,
+				     uint64_t *, int);
+    extern int RabbitMQ_dequeue_into(RMQ_conn_t *, RMQ_info_t *,
+				     uint64_t *, int, char *, size_t);
+    extern int RabbitMQ_dequeue_wait(RMQ_conn_t *, RMQ_info_t *,
+				     uint64_t *, int, char *, size_t, int);
+    extern int RabbitMQ_dequeue_stream(RMQ_conn_t *, RMQ_info_t *,
+				       uint64_t *, int,
+				       int (*)(const char *, size_t, void *),
+				       void *);
+    extern int RabbitMQ_dequeue_table(RMQ_conn_t *, char *, size_t, int,
+				      int *, uint64_t *, int, int);
     extern void RabbitMQ_dump(char *, int);
     extern void RabbitMQ_free_info(RMQ_info_t *);
     extern int RabbitMQ_serve(RMQ_conn_t *, int (*)(RMQ_info_t *, void *),
@@ -95,14 +239,60 @@ extern "C" {
 					char *, amqp_table_t *);
     extern int RabbitMQ_rpc_call(RMQ_conn_t *, char *, char *, char *, int,
 				 RMQ_info_t *);
+    extern RMQ_rpc_t *RabbitMQ_rpc_send(RMQ_conn_t *, char *, char *,
+					char *, int);
+    extern int RabbitMQ_rpc_wait(RMQ_conn_t *, RMQ_rpc_t *, RMQ_info_t *,
+				 int);
+    extern int RabbitMQ_rpc_wait_any(RMQ_conn_t *, RMQ_rpc_t **, int,
+				     RMQ_info_t *, int, int *);
+    extern int RabbitMQ_rpc_wait_all(RMQ_conn_t *, RMQ_rpc_t **, int,
+				     RMQ_info_t *, int);
+    extern void RabbitMQ_rpc_cancel(RMQ_conn_t *, RMQ_rpc_t *);
+    extern int RabbitMQ_rpc_direct(RMQ_conn_t *, int);
     extern int RabbitMQ_qos(RMQ_conn_t *, int, int, int);
     extern int RabbitMQ_get(RMQ_conn_t *, const char *, RMQ_info_t *, int);
+    extern int RabbitMQ_get_view(RMQ_conn_t *, const char *, RMQ_info_t *,
+				 int);
+    extern int RabbitMQ_get_into(RMQ_conn_t *, const char *, RMQ_info_t *,
+				 int, char *, size_t);
+    extern int RabbitMQ_get_stream(RMQ_conn_t *, const char *,
+				   RMQ_info_t *, int,
+				   int (*)(const char *, size_t, void *),
+				   void *);
     extern RMQ_info_t *RabbitMQ_alloc_info();
     extern int RabbitMQ_tx_select(RMQ_conn_t *);
     extern int RabbitMQ_tx_commit(RMQ_conn_t *);
     extern int RabbitMQ_tx_rollback(RMQ_conn_t *);
+    extern int RabbitMQ_confirm_select(RMQ_conn_t *, int,
+				       void (*)(uint64_t, int, void *),
+				       void *);
+    extern void RabbitMQ_confirm_deadline(RMQ_conn_t *, int);
+    extern int RabbitMQ_confirm_wait(RMQ_conn_t *, int);
+    extern int RabbitMQ_confirm_poll(RMQ_conn_t *);
+    extern uint64_t RabbitMQ_confirm_seq(RMQ_conn_t *);
     extern int RabbitMQ_cancel(RMQ_conn_t *, char *);
+    extern int RabbitMQ_ack(RMQ_conn_t *, uint64_t, int);
+    extern int RabbitMQ_nack(RMQ_conn_t *, uint64_t, int, int);
+    extern int RabbitMQ_ack_batch(RMQ_conn_t *, int, int);
+    extern int RabbitMQ_ack_flush(RMQ_conn_t *);
     extern void RabbitMQ_release(RMQ_conn_t *);
+    extern void RabbitMQ_arena_stats(RMQ_conn_t *, RMQ_arena_stats_t *,
+				     int);
+    extern void RabbitMQ_stats(RMQ_conn_t *, RMQ_stats_t *, int);
+    extern uint64_t RabbitMQ_percentile(RMQ_hist_t *, double);
+    extern int RabbitMQ_capture(RMQ_conn_t *, char *);
+    extern int RabbitMQ_failover(RMQ_conn_t *, char *);
+    extern int RabbitMQ_topology_cache(RMQ_conn_t *, int);
+    extern int RabbitMQ_pipeline(RMQ_conn_t *, int);
+    extern int RabbitMQ_sync(RMQ_conn_t *);
+#if !defined(__VMS) && !defined(_WIN32)
+    extern int RabbitMQ_fd_read(char *, size_t, void *);
+    extern int RabbitMQ_fd_write(const char *, size_t, void *);
+    extern int RabbitMQ_spool(RMQ_conn_t *, char *, size_t);
+    extern int RabbitMQ_spool_flush(RMQ_conn_t *, int);
+    extern RMQ_conn_t *RabbitMQ_replay(char *, int);
+    extern RMQ_conn_t *RabbitMQ_replay_synthetic(long, int);
+#endif
 
 #ifndef _WIN32
 #ifdef __VMS
@@ -116,6 +306,29 @@ extern "C" {
     extern pthread_t RabbitMQ_serve_thread(RMQ_conn_t *,
 					   int (*)(RMQ_info_t *, void *),
 					   int, void *, int);
+
+    typedef struct RMQ_pool_ RMQ_pool_t;
+
+    extern RMQ_pool_t *RabbitMQ_pool_start(RMQ_conn_t **, int, int, int,
+					   int (*)(RMQ_info_t *, void *),
+					   int, void *);
+    extern void RabbitMQ_pool_stop(RMQ_pool_t *);
+#endif
+
+#ifdef __linux__
+    typedef struct RMQ_loop_ RMQ_loop_t;
+
+    extern RMQ_loop_t *RabbitMQ_loop_new(void);
+    extern void RabbitMQ_loop_free(RMQ_loop_t *);
+    extern int RabbitMQ_loop_add(RMQ_loop_t *, RMQ_conn_t *,
+				 int (*)(RMQ_info_t *, void *), int,
+				 void *);
+    extern int RabbitMQ_loop_remove(RMQ_loop_t *, RMQ_conn_t *);
+    extern int RabbitMQ_loop_timer(RMQ_loop_t *, int, int,
+				   int (*)(void *), void *);
+    extern void RabbitMQ_loop_timer_cancel(RMQ_loop_t *, int);
+    extern void RabbitMQ_loop_stop(RMQ_loop_t *);
+    extern int RabbitMQ_loop_run(RMQ_loop_t *, int);
 #endif
 
 #ifdef __cplusplus
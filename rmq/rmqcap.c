@@ -0,0 +1,275 @@
+/*
+ *
+ * Copyright (c) 2021, Brett Cameron
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * Frame capture and replay, as used by RabbitMQ_capture() and RabbitMQ_replay()
+ * and by the server's -C and -R options. A capture file is RMQ_CAPTURE_MAGIC
+ * followed by frames in wire format (type, channel, size, payload, frame-end),
+ * i.e. exactly what the broker sent as far as librabbitmq is concerned. The
+ * frames have already been decoded by the time they are recorded, so methods
+ * and properties are re-encoded; bodies are written as received. Heartbeats are
+ * left out. Replaying writes a loaded file into one end of a socketpair, as fast
+ * as the reader at the other end takes it.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __VMS
+#include <inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <errno.h>
+#if !defined(__VMS) && !defined(_WIN32)
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+#include "rmq.h"
+#include "rmqcap.h"
+
+
+void rmq_put16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char) (v >> 8);
+    p[1] = (unsigned char) v;
+}
+
+
+void rmq_put32(unsigned char *p, uint32_t v)
+{
+    rmq_put16(p, (uint16_t) (v >> 16));
+    rmq_put16(p + 2, (uint16_t) v);
+}
+
+
+void rmq_put64(unsigned char *p, uint64_t v)
+{
+    rmq_put32(p, (uint32_t) (v >> 32));
+    rmq_put32(p + 4, (uint32_t) v);
+}
+
+
+/*
+ * Encodes a frame into "buf" (room for "max" bytes of payload plus 8) in wire
+ * format. Returns its length, 0 for a frame that is not recorded (heartbeats),
+ * or -1 if it cannot be encoded.
+ */
+int rmq_frame_encode(unsigned char *buf, size_t max, amqp_frame_t * fp)
+{
+    amqp_bytes_t enc;
+    size_t len;
+    int rv;
+
+    switch (fp->frame_type) {
+    case AMQP_FRAME_METHOD:
+	rmq_put32(buf + 7, fp->payload.method.id);
+	enc.bytes = buf + 11;
+	enc.len = max - 4;
+
+	if ((rv = amqp_encode_method(fp->payload.method.id,
+				     fp->payload.method.decoded, enc)) < 0) {
+	    return (-1);
+	}
+
+	len = rv + 4;
+	break;
+
+    case AMQP_FRAME_HEADER:
+	rmq_put16(buf + 7, fp->payload.properties.class_id);
+	rmq_put16(buf + 9, 0);
+	rmq_put64(buf + 11, fp->payload.properties.body_size);
+	enc.bytes = buf + 19;
+	enc.len = max - 12;
+
+	if ((rv = amqp_encode_properties(fp->payload.properties.class_id,
+					 fp->payload.properties.decoded,
+					 enc)) < 0) {
+	    return (-1);
+	}
+
+	len = rv + 12;
+	break;
+
+    case AMQP_FRAME_BODY:
+	if ((len = fp->payload.body_fragment.len) > max) {
+	    return (-1);
+	}
+
+	memcpy(buf + 7, fp->payload.body_fragment.bytes, len);
+	break;
+
+    default:
+	return (0);
+    }
+
+    buf[0] = fp->frame_type;
+    rmq_put16(buf + 1, fp->channel);
+    rmq_put32(buf + 3, (uint32_t) len);
+    buf[7 + len] = AMQP_FRAME_END;
+
+    return ((int) len + 8);
+}
+
+
+/* Creates a capture file, ready for frames; NULL (with errno set) on error */
+FILE *rmq_capture_open(const char *path)
+{
+    FILE *fp;
+
+    if ((fp = fopen(path, "wb")) == NULL) {
+	return (NULL);
+    }
+
+    if (fwrite(RMQ_CAPTURE_MAGIC, 1, 8, fp) != 8) {
+	fclose(fp);
+	return (NULL);
+    }
+
+    return (fp);
+}
+
+
+#if !defined(__VMS) && !defined(_WIN32)
+/*
+ * Reads a capture file into memory, without the magic and with every frame
+ * moved onto channel 1, and returns it (to be freed by the caller) with its
+ * length in *len. Returns NULL with errno set on error: EINVAL if the file is
+ * not a capture file, in which case *len is the offset of the first frame that
+ * is not whole (or 0 if the magic is wrong).
+ */
+char *rmq_capture_load(const char *path, size_t *len)
+{
+    unsigned char *p;
+    char *data;
+    FILE *in;
+    long size;
+    size_t off;
+    uint32_t flen;
+
+    *len = 0;
+
+    if ((in = fopen(path, "rb")) == NULL) {
+	return (NULL);
+    }
+
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    if ((data = (char *) malloc(size > 0 ? size : 1)) == NULL) {
+	fclose(in);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    if (size < 8 || fread(data, 1, size, in) != (size_t) size
+	|| memcmp(data, RMQ_CAPTURE_MAGIC, 8) != 0) {
+	fclose(in);
+	free(data);
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    fclose(in);
+
+    /* Drop the magic, check the framing and move everything onto channel 1 */
+    size -= 8;
+    memmove(data, data + 8, size);
+
+    for (off = 0; off + 8 <= (size_t) size; off += flen + 8) {
+	p = (unsigned char *) data + off;
+	flen = ((uint32_t) p[3] << 24) | (p[4] << 16) | (p[5] << 8) | p[6];
+
+	if (size - off - 8 < flen || p[7 + flen] != AMQP_FRAME_END) {
+	    break;
+	}
+
+	if (p[1] != 0 || p[2] != 0) {
+	    rmq_put16(p + 1, 1);
+	}
+    }
+
+    if (off != (size_t) size) {
+	free(data);
+	*len = off + 8;
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    *len = size;
+    return (data);
+}
+
+
+/* Writes to the reader, draining its output as we go; -1 once it has gone */
+int rmq_feed_write(int fd, const char *buf, size_t len)
+{
+    struct pollfd pfd;
+    char junk[4096];
+    ssize_t n;
+
+    while (len > 0) {
+	pfd.fd = fd;
+	pfd.events = POLLIN | POLLOUT;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, -1) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return (-1);
+	}
+
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+	    if (read(fd, junk, sizeof(junk)) <= 0) {
+		return (-1);
+	    }
+	}
+
+	if (pfd.revents & POLLOUT) {
+	    if ((n = send(fd, buf, len, RMQ_NOSIGNAL)) < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+		    continue;
+		}
+		return (-1);
+	    }
+
+	    buf += n;
+	    len -= n;
+	}
+    }
+
+    return (0);
+}
+
+
+/* End of stream: waits for the reader to go away, then closes the socket */
+void rmq_feed_end(int fd)
+{
+    char junk[4096];
+
+    shutdown(fd, SHUT_WR);
+    while (read(fd, junk, sizeof(junk)) > 0);
+
+    close(fd);
+}
+#endif				/* !__VMS && !_WIN32 */
@@ -0,0 +1,49 @@
+/*
+ *
+ * Copyright (c) 2021, Brett Cameron
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Capture file and replay helpers, shared by rmq.c and ../amqp-server (see rmqcap.c) */
+
+#ifndef __RMQCAP_H__
+#define __RMQCAP_H__
+
+/* For send(): a peer that has gone away is an error, not a SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define RMQ_NOSIGNAL MSG_NOSIGNAL
+#else
+#define RMQ_NOSIGNAL 0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern void rmq_put16(unsigned char *, uint16_t);
+    extern void rmq_put32(unsigned char *, uint32_t);
+    extern void rmq_put64(unsigned char *, uint64_t);
+    extern int rmq_frame_encode(unsigned char *, size_t, amqp_frame_t *);
+    extern FILE *rmq_capture_open(const char *);
+#if !defined(__VMS) && !defined(_WIN32)
+    extern char *rmq_capture_load(const char *, size_t *);
+    extern int rmq_feed_write(int, const char *, size_t);
+    extern void rmq_feed_end(int);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif
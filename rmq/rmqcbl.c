@@ -73,139 +73,1814 @@ static char *mkstr(char *str, int len)
 }
 
 
+/*
+ * Like mkstr(), but points into the caller's field rather than copying it; as
+ * there, a NUL (LOW-VALUES) ends the string before trailing spaces go.
+ */
+static amqp_bytes_t mkbytes(char *str, int len)
+{
+    amqp_bytes_t b;
+    char *cp;
+
+    if (len == 0) {
+	len = strlen(str);
+    } else {
+	if ((cp = (char *) memchr(str, '\0', len)) != NULL) {
+	    len = cp - str;
+	}
+
+	while (len > 0 && isspace((unsigned char) str[len - 1])) {
+	    len--;
+	}
+    }
+
+    b.bytes = str;
+    b.len = len;
+    return (b);
+}
+
+
+/* Fills a PIC X field of "size" bytes with "len" bytes of "src" and spaces */
+static void cblcpy(char *dst, int size, const void *src, size_t len)
+{
+    if (dst == NULL || size <= 0) {
+	return;
+    }
+
+    if (len > (size_t) size) {
+	len = size;
+    }
+
+    if (len != 0) {
+	memcpy(dst, src, len);
+    }
+
+    memset(dst + len, ' ', size - len);
+}
+
+
+/*
+ * Trims a short string (exchange, queue or routing key) into "dst", which has
+ * room for 256 bytes; -1 (and ch->errstr set) if it is too long to be one.
+ */
+static int shortstr(RMQ_conn_t * ch, char *dst, char *str, int len)
+{
+    amqp_bytes_t b = mkbytes(str, len);
+
+    if (b.len > 255) {
+	sprintf(ch->errstr, "Name is longer than 255 bytes");
+	return (-1);
+    }
+
+    memcpy(dst, b.bytes, b.len);
+    dst[b.len] = '\0';
+    return (0);
+}
+
+
+/* See RMQ_PREPARE_PUBLISH */
+typedef struct {
+    RMQ_conn_t *ch;
+    amqp_bytes_t exch;
+    amqp_bytes_t rkey;
+    int mand;
+    int immed;
+    amqp_basic_properties_t props;
+    amqp_basic_properties_t *pp;
+    char names[512];		/* Where exch and rkey point */
+} RMQ_prepared_t;
+
+
+/*
+ * Payload conversion, for data to and from mainframes: EBCDIC text, packed
+ * decimal (COMP-3) and zoned decimal (DISPLAY) on the wire; ISO 8859-1 and
+ * native binary (COMP-5) here. Binary values are unscaled, so PIC S9(7)V99
+ * COMP-3 becomes PIC S9(7)V99 COMP-5. The kernels are plain C, decoding eight
+ * digits at a time in a 64-bit word on little-endian machines; on x86 (GCC or
+ * clang) cvt_init() switches translation to AVX2 and encoding to SSE2 at load
+ * time if the CPU has them. Build with -DRMQ_NO_SIMD to do without.
+ */
+#define RMQ_FIELD_TEXT		1	/* EBCDIC <-> ISO 8859-1 */
+#define RMQ_FIELD_PACKED	2	/* COMP-3 <-> COMP-5 */
+#define RMQ_FIELD_ZONED		3	/* EBCDIC signed DISPLAY <-> COMP-5 */
+#define RMQ_FIELD_COPY		4	/* As is */
+
+#define RMQ_MAX_PACKED		10	/* Bytes, for 19 digits and a sign */
+#define RMQ_MAX_ZONED		18
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+    && !defined(RMQ_NO_SIMD)
+#define RMQ_CVT_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__VMS) || defined(_WIN32) || (defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define RMQ_CVT_SWAR
+#define RMQ_ONES		UINT64_C(0x0101010101010101)
+#endif
+
+
+/* EBCDIC code page 37 to ISO 8859-1, and back */
+static const unsigned char e2a_037[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x9c, 0x09, 0x86, 0x7f,
+    0x97, 0x8d, 0x8e, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x9d, 0x85, 0x08, 0x87,
+    0x18, 0x19, 0x92, 0x8f, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x0a, 0x17, 0x1b,
+    0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x05, 0x06, 0x07,
+    0x90, 0x91, 0x16, 0x93, 0x94, 0x95, 0x96, 0x04,
+    0x98, 0x99, 0x9a, 0x9b, 0x14, 0x15, 0x9e, 0x1a,
+    0x20, 0xa0, 0xe2, 0xe4, 0xe0, 0xe1, 0xe3, 0xe5,
+    0xe7, 0xf1, 0xa2, 0x2e, 0x3c, 0x28, 0x2b, 0x7c,
+    0x26, 0xe9, 0xea, 0xeb, 0xe8, 0xed, 0xee, 0xef,
+    0xec, 0xdf, 0x21, 0x24, 0x2a, 0x29, 0x3b, 0xac,
+    0x2d, 0x2f, 0xc2, 0xc4, 0xc0, 0xc1, 0xc3, 0xc5,
+    0xc7, 0xd1, 0xa6, 0x2c, 0x25, 0x5f, 0x3e, 0x3f,
+    0xf8, 0xc9, 0xca, 0xcb, 0xc8, 0xcd, 0xce, 0xcf,
+    0xcc, 0x60, 0x3a, 0x23, 0x40, 0x27, 0x3d, 0x22,
+    0xd8, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0xab, 0xbb, 0xf0, 0xfd, 0xfe, 0xb1,
+    0xb0, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70,
+    0x71, 0x72, 0xaa, 0xba, 0xe6, 0xb8, 0xc6, 0xa4,
+    0xb5, 0x7e, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0xa1, 0xbf, 0xd0, 0xdd, 0xde, 0xae,
+    0x5e, 0xa3, 0xa5, 0xb7, 0xa9, 0xa7, 0xb6, 0xbc,
+    0xbd, 0xbe, 0x5b, 0x5d, 0xaf, 0xa8, 0xb4, 0xd7,
+    0x7b, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0xad, 0xf4, 0xf6, 0xf2, 0xf3, 0xf5,
+    0x7d, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50,
+    0x51, 0x52, 0xb9, 0xfb, 0xfc, 0xf9, 0xfa, 0xff,
+    0x5c, 0xf7, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0xb2, 0xd4, 0xd6, 0xd2, 0xd3, 0xd5,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0xb3, 0xdb, 0xdc, 0xd9, 0xda, 0x9f
+};
+
+static const unsigned char a2e_037[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x37, 0x2d, 0x2e, 0x2f,
+    0x16, 0x05, 0x25, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x3c, 0x3d, 0x32, 0x26,
+    0x18, 0x19, 0x3f, 0x27, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x40, 0x5a, 0x7f, 0x7b, 0x5b, 0x6c, 0x50, 0x7d,
+    0x4d, 0x5d, 0x5c, 0x4e, 0x6b, 0x60, 0x4b, 0x61,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0x7a, 0x5e, 0x4c, 0x7e, 0x6e, 0x6f,
+    0x7c, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6,
+    0xd7, 0xd8, 0xd9, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6,
+    0xe7, 0xe8, 0xe9, 0xba, 0xe0, 0xbb, 0xb0, 0x6d,
+    0x79, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6,
+    0xa7, 0xa8, 0xa9, 0xc0, 0x4f, 0xd0, 0xa1, 0x07,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x15, 0x06, 0x17,
+    0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x09, 0x0a, 0x1b,
+    0x30, 0x31, 0x1a, 0x33, 0x34, 0x35, 0x36, 0x08,
+    0x38, 0x39, 0x3a, 0x3b, 0x04, 0x14, 0x3e, 0xff,
+    0x41, 0xaa, 0x4a, 0xb1, 0x9f, 0xb2, 0x6a, 0xb5,
+    0xbd, 0xb4, 0x9a, 0x8a, 0x5f, 0xca, 0xaf, 0xbc,
+    0x90, 0x8f, 0xea, 0xfa, 0xbe, 0xa0, 0xb6, 0xb3,
+    0x9d, 0xda, 0x9b, 0x8b, 0xb7, 0xb8, 0xb9, 0xab,
+    0x64, 0x65, 0x62, 0x66, 0x63, 0x67, 0x9e, 0x68,
+    0x74, 0x71, 0x72, 0x73, 0x78, 0x75, 0x76, 0x77,
+    0xac, 0x69, 0xed, 0xee, 0xeb, 0xef, 0xec, 0xbf,
+    0x80, 0xfd, 0xfe, 0xfb, 0xfc, 0xad, 0xae, 0x59,
+    0x44, 0x45, 0x42, 0x46, 0x43, 0x47, 0x9c, 0x48,
+    0x54, 0x51, 0x52, 0x53, 0x58, 0x55, 0x56, 0x57,
+    0x8c, 0x49, 0xcd, 0xce, 0xcb, 0xcf, 0xcc, 0xe1,
+    0x70, 0xdd, 0xde, 0xdb, 0xdc, 0x8d, 0x8e, 0xdf
+};
+
+
+/* EBCDIC code page 500 to ISO 8859-1, and back */
+static const unsigned char e2a_500[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x9c, 0x09, 0x86, 0x7f,
+    0x97, 0x8d, 0x8e, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x9d, 0x85, 0x08, 0x87,
+    0x18, 0x19, 0x92, 0x8f, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x0a, 0x17, 0x1b,
+    0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x05, 0x06, 0x07,
+    0x90, 0x91, 0x16, 0x93, 0x94, 0x95, 0x96, 0x04,
+    0x98, 0x99, 0x9a, 0x9b, 0x14, 0x15, 0x9e, 0x1a,
+    0x20, 0xa0, 0xe2, 0xe4, 0xe0, 0xe1, 0xe3, 0xe5,
+    0xe7, 0xf1, 0x5b, 0x2e, 0x3c, 0x28, 0x2b, 0x21,
+    0x26, 0xe9, 0xea, 0xeb, 0xe8, 0xed, 0xee, 0xef,
+    0xec, 0xdf, 0x5d, 0x24, 0x2a, 0x29, 0x3b, 0x5e,
+    0x2d, 0x2f, 0xc2, 0xc4, 0xc0, 0xc1, 0xc3, 0xc5,
+    0xc7, 0xd1, 0xa6, 0x2c, 0x25, 0x5f, 0x3e, 0x3f,
+    0xf8, 0xc9, 0xca, 0xcb, 0xc8, 0xcd, 0xce, 0xcf,
+    0xcc, 0x60, 0x3a, 0x23, 0x40, 0x27, 0x3d, 0x22,
+    0xd8, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0xab, 0xbb, 0xf0, 0xfd, 0xfe, 0xb1,
+    0xb0, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70,
+    0x71, 0x72, 0xaa, 0xba, 0xe6, 0xb8, 0xc6, 0xa4,
+    0xb5, 0x7e, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0xa1, 0xbf, 0xd0, 0xdd, 0xde, 0xae,
+    0xa2, 0xa3, 0xa5, 0xb7, 0xa9, 0xa7, 0xb6, 0xbc,
+    0xbd, 0xbe, 0xac, 0x7c, 0xaf, 0xa8, 0xb4, 0xd7,
+    0x7b, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0xad, 0xf4, 0xf6, 0xf2, 0xf3, 0xf5,
+    0x7d, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50,
+    0x51, 0x52, 0xb9, 0xfb, 0xfc, 0xf9, 0xfa, 0xff,
+    0x5c, 0xf7, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0xb2, 0xd4, 0xd6, 0xd2, 0xd3, 0xd5,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0xb3, 0xdb, 0xdc, 0xd9, 0xda, 0x9f
+};
+
+static const unsigned char a2e_500[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x37, 0x2d, 0x2e, 0x2f,
+    0x16, 0x05, 0x25, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x3c, 0x3d, 0x32, 0x26,
+    0x18, 0x19, 0x3f, 0x27, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x40, 0x4f, 0x7f, 0x7b, 0x5b, 0x6c, 0x50, 0x7d,
+    0x4d, 0x5d, 0x5c, 0x4e, 0x6b, 0x60, 0x4b, 0x61,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0x7a, 0x5e, 0x4c, 0x7e, 0x6e, 0x6f,
+    0x7c, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6,
+    0xd7, 0xd8, 0xd9, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6,
+    0xe7, 0xe8, 0xe9, 0x4a, 0xe0, 0x5a, 0x5f, 0x6d,
+    0x79, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6,
+    0xa7, 0xa8, 0xa9, 0xc0, 0xbb, 0xd0, 0xa1, 0x07,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x15, 0x06, 0x17,
+    0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x09, 0x0a, 0x1b,
+    0x30, 0x31, 0x1a, 0x33, 0x34, 0x35, 0x36, 0x08,
+    0x38, 0x39, 0x3a, 0x3b, 0x04, 0x14, 0x3e, 0xff,
+    0x41, 0xaa, 0xb0, 0xb1, 0x9f, 0xb2, 0x6a, 0xb5,
+    0xbd, 0xb4, 0x9a, 0x8a, 0xba, 0xca, 0xaf, 0xbc,
+    0x90, 0x8f, 0xea, 0xfa, 0xbe, 0xa0, 0xb6, 0xb3,
+    0x9d, 0xda, 0x9b, 0x8b, 0xb7, 0xb8, 0xb9, 0xab,
+    0x64, 0x65, 0x62, 0x66, 0x63, 0x67, 0x9e, 0x68,
+    0x74, 0x71, 0x72, 0x73, 0x78, 0x75, 0x76, 0x77,
+    0xac, 0x69, 0xed, 0xee, 0xeb, 0xef, 0xec, 0xbf,
+    0x80, 0xfd, 0xfe, 0xfb, 0xfc, 0xad, 0xae, 0x59,
+    0x44, 0x45, 0x42, 0x46, 0x43, 0x47, 0x9c, 0x48,
+    0x54, 0x51, 0x52, 0x53, 0x58, 0x55, 0x56, 0x57,
+    0x8c, 0x49, 0xcd, 0xce, 0xcb, 0xcf, 0xcc, 0xe1,
+    0x70, 0xdd, 0xde, 0xdb, 0xdc, 0x8d, 0x8e, 0xdf
+};
+
+
+static const struct {
+    int ccsid;
+    const unsigned char *e2a;
+    const unsigned char *a2e;
+} cvt_pages[] = {
+    { 37, e2a_037, a2e_037 },
+    { 500, e2a_500, a2e_500 }
+};
+
+
+/* Looks up a code page (0 for 37); -1 if it isn't one we have */
+static int cvt_page(int ccsid)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(cvt_pages) / sizeof(cvt_pages[0])); i++) {
+	if (cvt_pages[i].ccsid == (ccsid == 0 ? 37 : ccsid)) {
+	    return (i);
+	}
+    }
+
+    return (-1);
+}
+
+
+/* Sign nibble of packed (or zone of zoned) decimal: 1 minus, 0 plus, -1 bad */
+static int cvt_psign(int n)
+{
+    switch (n) {
+    case 0x0B:
+    case 0x0D:
+	return (1);
+
+    case 0x0A:
+    case 0x0C:
+    case 0x0E:
+    case 0x0F:
+	return (0);
+
+    default:
+	return (-1);
+    }
+}
+
+
+/* The same for the last byte of zoned decimal (GnuCOBOL's if not EBCDIC) */
+static int cvt_zsign(int c, int ebcdic)
+{
+    if (ebcdic) {
+	return (cvt_psign(c >> 4));
+    }
+
+    return ((c & 0xF0) == 0x30 ? 0 : (c & 0xF0) == 0x70 ? 1 : -1);
+}
+
+
+static int cvt_signed(uint64_t u, int neg, int64_t * val)
+{
+    if (u > (uint64_t) INT64_MAX + neg) {
+	return (-1);
+    }
+
+    *val = (neg ? (int64_t) (0 - u) : (int64_t) u);
+    return (0);
+}
+
+
+/* Four loads before the stores, which might otherwise alias the table */
+static void
+xlate_c(const unsigned char *tab, const unsigned char *src,
+	unsigned char *dst, size_t len)
+{
+    unsigned char a;
+    unsigned char b;
+    unsigned char c;
+    unsigned char d;
+    size_t i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+	a = tab[src[i]];
+	b = tab[src[i + 1]];
+	c = tab[src[i + 2]];
+	d = tab[src[i + 3]];
+	dst[i] = a;
+	dst[i + 1] = b;
+	dst[i + 2] = c;
+	dst[i + 3] = d;
+    }
+
+    for (; i < len; i++) {
+	dst[i] = tab[src[i]];
+    }
+}
+
+
+#ifdef RMQ_CVT_SWAR
+/*
+ * Eight bytes, each a digit in base "b" (at most 100), to a number; the first
+ * byte in memory is the most significant, i.e. the lowest in the word.
+ */
+static uint64_t cvt_swar(uint64_t x, uint64_t b)
+{
+    x = (x & UINT64_C(0x00FF00FF00FF00FF)) * b
+	+ ((x >> 8) & UINT64_C(0x00FF00FF00FF00FF));
+    x = (x & UINT64_C(0x0000FFFF0000FFFF)) * (b * b)
+	+ ((x >> 16) & UINT64_C(0x0000FFFF0000FFFF));
+
+    return ((x & UINT64_C(0xFFFFFFFF)) * (b * b * b * b) + (x >> 32));
+}
+#endif
+
+
+/* Packed decimal ("len" bytes) to binary; -1 if it isn't valid or won't fit */
+static int unpack_c(const unsigned char *src, int len, int64_t * val)
+{
+    uint64_t u = 0;
+    int neg;
+    int i = 0;
+
+#ifdef RMQ_CVT_SWAR
+    uint64_t x;
+    uint64_t hi;
+    uint64_t lo;
+
+    /* 16 digits a go: each byte becomes 0-99, and then it's base 100 */
+    for (; i + 8 <= len - 1; i += 8) {
+	memcpy(&x, src + i, 8);
+	hi = (x >> 4) & (RMQ_ONES * 0x0F);
+	lo = x & (RMQ_ONES * 0x0F);
+
+	if (((hi + RMQ_ONES * 6) | (lo + RMQ_ONES * 6)) & (RMQ_ONES * 0xF0)) {
+	    return (-1);
+	}
+
+	u = u * UINT64_C(10000000000000000) + cvt_swar(hi * 10 + lo, 100);
+    }
+#endif
+
+    for (; i < len - 1; i++) {
+	if ((src[i] >> 4) > 9 || (src[i] & 0x0F) > 9) {
+	    return (-1);
+	}
+
+	u = u * 100 + (src[i] >> 4) * 10 + (src[i] & 0x0F);
+    }
+
+    if ((src[i] >> 4) > 9 || (neg = cvt_psign(src[i] & 0x0F)) == -1) {
+	return (-1);
+    }
+
+    return (cvt_signed(u * 10 + (src[i] >> 4), neg, val));
+}
+
+
+/* Zoned decimal with a trailing embedded sign to binary */
+static int
+unzone_c(const unsigned char *src, int len, int ebcdic, int64_t * val)
+{
+    uint64_t u = 0;
+    int zone = (ebcdic ? 0xF0 : 0x30);
+    int neg;
+    int i = 0;
+
+#ifdef RMQ_CVT_SWAR
+    uint64_t x;
+
+    for (; i + 8 <= len - 1; i += 8) {
+	memcpy(&x, src + i, 8);
+
+	if ((x & (RMQ_ONES * 0xF0)) != RMQ_ONES * zone
+	    || (((x & (RMQ_ONES * 0x0F)) + RMQ_ONES * 6)
+		& (RMQ_ONES * 0xF0))) {
+	    return (-1);
+	}
+
+	u = u * 100000000 + cvt_swar(x & (RMQ_ONES * 0x0F), 10);
+    }
+#endif
+
+    for (; i < len - 1; i++) {
+	if ((src[i] & 0xF0) != zone || (src[i] & 0x0F) > 9) {
+	    return (-1);
+	}
+
+	u = u * 10 + (src[i] & 0x0F);
+    }
+
+    if ((src[i] & 0x0F) > 9 || (neg = cvt_zsign(src[i], ebcdic)) == -1) {
+	return (-1);
+    }
+
+    return (cvt_signed(u * 10 + (src[i] & 0x0F), neg, val));
+}
+
+
+/* Binary to "len" bytes of packed decimal (sign C or D); -1 if too big */
+static int pack_c(int64_t val, unsigned char *dst, int len)
+{
+    uint64_t u = (val < 0 ? 0 - (uint64_t) val : (uint64_t) val);
+    int i;
+
+    dst[len - 1] = (unsigned char) ((u % 10) << 4 | (val < 0 ? 0x0D : 0x0C));
+    u /= 10;
+
+    for (i = len - 2; i >= 0; i--) {
+	dst[i] = (unsigned char) ((u / 10 % 10) << 4 | u % 10);
+	u /= 100;
+    }
+
+    return (u == 0 ? 0 : -1);
+}
+
+
+/* Binary to zoned decimal, signed C or D in EBCDIC and 3 or 7 otherwise */
+static int zone_c(int64_t val, unsigned char *dst, int len, int ebcdic)
+{
+    uint64_t u = (val < 0 ? 0 - (uint64_t) val : (uint64_t) val);
+    int i;
+
+    for (i = len - 1; i >= 0; i--) {
+	dst[i] = (unsigned char) ((ebcdic ? 0xF0 : 0x30) | u % 10);
+	u /= 10;
+    }
+
+    if (ebcdic) {
+	dst[len - 1] = (dst[len - 1] & 0x0F) | (val < 0 ? 0xD0 : 0xC0);
+    } else if (val < 0) {
+	dst[len - 1] = (dst[len - 1] & 0x0F) | 0x70;
+    }
+
+    return (u == 0 ? 0 : -1);
+}
+
+
+#ifdef RMQ_CVT_SIMD
+/*
+ * A 256-byte table is looked up as sixteen 16-byte ones with pshufb. Taking
+ * 16 * k off each byte and adding 0x70 with unsigned saturation leaves bit 7
+ * clear only for bytes in the k'th sixteen, so the others look up as zero and
+ * the sixteen results can just be or'ed together. It takes a few hundred bytes
+ * to beat xlate_c().
+ */
+__attribute__ ((target("avx2")))
+static void
+xlate_avx2(const unsigned char *tab, const unsigned char *src,
+	   unsigned char *dst, size_t len)
+{
+    __m256i t[16];
+    __m256i bias = _mm256_set1_epi8(0x70);
+    __m256i step = _mm256_set1_epi8(0x10);
+    __m256i x;
+    __m256i r;
+    size_t i;
+    int k;
+
+    if (len < 256) {
+	xlate_c(tab, src, dst, len);
+	return;
+    }
+
+    for (k = 0; k < 16; k++) {
+	t[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128
+					   ((const __m128i *) (tab +
+							       16 * k)));
+    }
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *) (src + i));
+	r = _mm256_setzero_si256();
+
+	for (k = 0; k < 16; k++) {
+	    r = _mm256_or_si256(r,
+				_mm256_shuffle_epi8(t[k],
+						    _mm256_adds_epu8(x,
+								     bias)));
+	    x = _mm256_sub_epi8(x, step);
+	}
+
+	_mm256_storeu_si256((__m256i *) (dst + i), r);
+    }
+
+    xlate_c(tab, src + i, dst + i, len - i);
+}
+
+
+/*
+ * The eight decimal digits of v (< 10^8) as 16-bit lanes, most significant
+ * first: v is split into two halves of four digits, each of which is copied
+ * to four lanes and divided by 1000, 100, 10 and 1 with multiplications by
+ * reciprocals; taking ten times each lane's left neighbour away leaves one
+ * digit per lane.
+ */
+__attribute__ ((target("sse2")))
+static __m128i cvt_digits8(uint32_t v)
+{
+    __m128i x = _mm_cvtsi32_si128((int) v);
+    __m128i hi = _mm_srli_epi64(_mm_mul_epu32(x, _mm_set1_epi32((int)
+								0xD1B71759)),
+				45);
+    __m128i lo = _mm_sub_epi32(x, _mm_mul_epu32(hi, _mm_set1_epi32(10000)));
+    __m128i t = _mm_slli_epi64(_mm_unpacklo_epi16(hi, lo), 2);
+
+    t = _mm_unpacklo_epi16(t, t);
+    t = _mm_unpacklo_epi32(t, t);
+    t = _mm_mulhi_epu16(t, _mm_setr_epi16(8389, 5243, 13108, (short) 32768,
+					  8389, 5243, 13108,
+					  (short) 32768));
+    t = _mm_mulhi_epu16(t, _mm_setr_epi16(1 << 7, 1 << 11, 1 << 13,
+					  (short) (1 << 15), 1 << 7,
+					  1 << 11, 1 << 13,
+					  (short) (1 << 15)));
+
+    return (_mm_sub_epi16(t, _mm_slli_epi64(_mm_mullo_epi16(t,
+							    _mm_set1_epi16
+							    (10)), 16)));
+}
+
+
+/* The 16 digits of v (< 10^16), one a byte */
+__attribute__ ((target("sse2")))
+static __m128i cvt_digits16(uint64_t v)
+{
+    return (_mm_packus_epi16(cvt_digits8((uint32_t) (v / 100000000)),
+			     cvt_digits8((uint32_t) (v % 100000000))));
+}
+
+
+/*
+ * Packed decimal: the last 15 digits, times ten to leave room for the sign,
+ * make 16 digits that pair up into 8 bytes; the 4 above them are done by hand.
+ * Fields of under 15 digits are quicker done by pack_c().
+ */
+__attribute__ ((target("sse2")))
+static int pack_sse2(int64_t val, unsigned char *dst, int len)
+{
+    uint64_t u = (val < 0 ? 0 - (uint64_t) val : (uint64_t) val);
+    uint64_t top = u / UINT64_C(1000000000000000);
+    unsigned char tmp[16];
+    __m128i d;
+    int i;
+
+    if (len < 8) {
+	return (pack_c(val, dst, len));
+    }
+
+    d = cvt_digits16(u % UINT64_C(1000000000000000) * 10);
+    d = _mm_or_si128(_mm_slli_epi16(d, 4), _mm_srli_epi16(d, 8));
+    d = _mm_packus_epi16(_mm_and_si128(d, _mm_set1_epi16(0x00FF)),
+			 _mm_setzero_si128());
+    _mm_storel_epi64((__m128i *) (tmp + 8), d);
+
+    tmp[6] = (unsigned char) ((top / 1000) << 4 | (top / 100 % 10));
+    tmp[7] = (unsigned char) ((top / 10 % 10) << 4 | (top % 10));
+    tmp[15] |= (val < 0 ? 0x0D : 0x0C);
+
+    for (i = 6; i < 16 - len; i++) {
+	if (tmp[i] != 0) {
+	    return (-1);
+	}
+    }
+
+    memcpy(dst, tmp + 16 - len, len);
+    return (0);
+}
+
+
+/* Zoned decimal: 16 digits with the zone or'ed in, and 3 by hand above them */
+__attribute__ ((target("sse2")))
+static int zone_sse2(int64_t val, unsigned char *dst, int len, int ebcdic)
+{
+    uint64_t u = (val < 0 ? 0 - (uint64_t) val : (uint64_t) val);
+    uint64_t top = u / UINT64_C(10000000000000000);
+    unsigned char tmp[19];
+    int zone = (ebcdic ? 0xF0 : 0x30);
+    int i;
+
+    if (len < 12) {
+	return (zone_c(val, dst, len, ebcdic));
+    }
+
+    _mm_storeu_si128((__m128i *) (tmp + 3),
+		     _mm_or_si128(cvt_digits16
+				  (u % UINT64_C(10000000000000000)),
+				  _mm_set1_epi8((char) zone)));
+    tmp[0] = (unsigned char) (zone | top / 100);
+    tmp[1] = (unsigned char) (zone | top / 10 % 10);
+    tmp[2] = (unsigned char) (zone | top % 10);
+
+    for (i = 0; i < (int) sizeof(tmp) - len; i++) {
+	if ((tmp[i] & 0x0F) != 0) {
+	    return (-1);
+	}
+    }
+
+    memcpy(dst, tmp + sizeof(tmp) - len, len);
+
+    if (ebcdic) {
+	dst[len - 1] = (dst[len - 1] & 0x0F) | (val < 0 ? 0xD0 : 0xC0);
+    } else if (val < 0) {
+	dst[len - 1] = (dst[len - 1] & 0x0F) | 0x70;
+    }
+
+    return (0);
+}
+#endif				/* RMQ_CVT_SIMD */
+
+
+/* The kernels in use */
+static struct {
+    void (*xlate) (const unsigned char *, const unsigned char *,
+		   unsigned char *, size_t);
+    int (*pack) (int64_t, unsigned char *, int);
+    int (*zone) (int64_t, unsigned char *, int, int);
+} cvt = {
+xlate_c, pack_c, zone_c};
+
+
+#ifdef RMQ_CVT_SIMD
+__attribute__ ((constructor))
+static void cvt_init(void)
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+	cvt.pack = pack_sse2;
+	cvt.zone = zone_sse2;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+	cvt.xlate = xlate_avx2;
+    }
+}
+#endif
+
+
+/*
+ * A conversion profile (see RMQ_PROFILE) maps a record on the wire to one
+ * here, field by field. Without fields the whole body is text.
+ */
+typedef struct {
+    int type;			/* RMQ_FIELD_xxx */
+    int woff;			/* On the wire */
+    int wlen;
+    int loff;			/* Here */
+    int llen;
+} RMQ_field_t;
+
+typedef struct {
+    const unsigned char *e2a;
+    const unsigned char *a2e;
+    RMQ_field_t *fields;
+    int nfield;
+    int wire;			/* Record lengths */
+    int local;
+    unsigned char *buf;		/* Scratch for the wire side */
+    size_t size;
+} RMQ_profile_t;
+
+
+static void cvt_free(RMQ_profile_t * pp)
+{
+    if (pp != NULL) {
+	free(pp->fields);
+	free(pp->buf);
+	free(pp);
+    }
+}
+
+
+static unsigned char *cvt_buf(RMQ_profile_t * pp, size_t len)
+{
+    if (len > pp->size) {
+	RMQ_AllocAssert((pp->buf = (unsigned char *) realloc(pp->buf, len)));
+	pp->size = len;
+    }
+
+    return (pp->buf);
+}
+
+
+/* COMP-5 items of 1, 2, 4 or 8 bytes */
+static int64_t cvt_load(const unsigned char *p, int len)
+{
+    int8_t b;
+    int16_t h;
+    int32_t w;
+    int64_t d;
+
+    switch (len) {
+    case 1:
+	memcpy(&b, p, 1);
+	return (b);
+
+    case 2:
+	memcpy(&h, p, 2);
+	return (h);
+
+    case 4:
+	memcpy(&w, p, 4);
+	return (w);
+
+    default:
+	memcpy(&d, p, 8);
+	return (d);
+    }
+}
+
+
+static int cvt_store(unsigned char *p, int len, int64_t v)
+{
+    int8_t b = (int8_t) v;
+    int16_t h = (int16_t) v;
+    int32_t w = (int32_t) v;
+
+    switch (len) {
+    case 1:
+	memcpy(p, &b, 1);
+	return (b == v ? 0 : -1);
+
+    case 2:
+	memcpy(p, &h, 2);
+	return (h == v ? 0 : -1);
+
+    case 4:
+	memcpy(p, &w, 4);
+	return (w == v ? 0 : -1);
+
+    default:
+	memcpy(p, &v, 8);
+	return (0);
+    }
+}
+
+
+/*
+ * Wire record at "src" ("len" bytes) to local record at "dst"; anything
+ * between the fields is left as spaces. -1 if the message is too short or a
+ * number in it is bad or too big for its field.
+ */
+static int
+cvt_in(RMQ_profile_t * pp, const unsigned char *src, size_t len,
+       unsigned char *dst)
+{
+    RMQ_field_t *fp;
+    int64_t v;
+    int i;
+
+    if (len < (size_t) pp->wire) {
+	return (-1);
+    }
+
+    memset(dst, ' ', pp->local);
+
+    for (i = 0; i < pp->nfield; i++) {
+	fp = &pp->fields[i];
+
+	switch (fp->type) {
+	case RMQ_FIELD_TEXT:
+	    cvt.xlate(pp->e2a, src + fp->woff, dst + fp->loff,
+		      fp->wlen < fp->llen ? fp->wlen : fp->llen);
+	    break;
+
+	case RMQ_FIELD_PACKED:
+	    if (unpack_c(src + fp->woff, fp->wlen, &v) == -1
+		|| cvt_store(dst + fp->loff, fp->llen, v) == -1) {
+		return (-1);
+	    }
+
+	    break;
+
+	case RMQ_FIELD_ZONED:
+	    if (unzone_c(src + fp->woff, fp->wlen, 1, &v) == -1
+		|| cvt_store(dst + fp->loff, fp->llen, v) == -1) {
+		return (-1);
+	    }
+
+	    break;
+
+	default:
+	    memcpy(dst + fp->loff, src + fp->woff,
+		   fp->wlen < fp->llen ? fp->wlen : fp->llen);
+	    break;
+	}
+    }
+
+    return (pp->local);
+}
+
+
+/* And back again: local record to wire record, padded with EBCDIC spaces */
+static int
+cvt_out(RMQ_profile_t * pp, const unsigned char *src, size_t len,
+	unsigned char *dst)
+{
+    RMQ_field_t *fp;
+    int i;
+
+    if (len < (size_t) pp->local) {
+	return (-1);
+    }
+
+    memset(dst, pp->a2e[' '], pp->wire);
+
+    for (i = 0; i < pp->nfield; i++) {
+	fp = &pp->fields[i];
+
+	switch (fp->type) {
+	case RMQ_FIELD_TEXT:
+	    cvt.xlate(pp->a2e, src + fp->loff, dst + fp->woff,
+		      fp->wlen < fp->llen ? fp->wlen : fp->llen);
+	    break;
+
+	case RMQ_FIELD_PACKED:
+	    if (cvt.pack(cvt_load(src + fp->loff, fp->llen), dst + fp->woff,
+			 fp->wlen) == -1) {
+		return (-1);
+	    }
+
+	    break;
+
+	case RMQ_FIELD_ZONED:
+	    if (cvt.zone(cvt_load(src + fp->loff, fp->llen), dst + fp->woff,
+			 fp->wlen, 1) == -1) {
+		return (-1);
+	    }
+
+	    break;
+
+	default:
+	    memcpy(dst + fp->woff, src + fp->loff,
+		   fp->wlen < fp->llen ? fp->wlen : fp->llen);
+	    break;
+	}
+    }
+
+    return (pp->wire);
+}
+
+
+/* Converts an outgoing body with the handle's profile; it then points at scratch */
+static int cblout(RMQ_conn_t * ch, amqp_bytes_t * data)
+{
+    RMQ_profile_t *pp = (RMQ_profile_t *) ch->cvt;
+    unsigned char *buf;
+
+    if (pp == NULL) {
+	return (0);
+    }
+
+    if (pp->nfield == 0) {
+	buf = cvt_buf(pp, data->len);
+	cvt.xlate(pp->a2e, (unsigned char *) data->bytes, buf, data->len);
+    } else {
+	buf = cvt_buf(pp, pp->wire);
+
+	if (cvt_out(pp, (unsigned char *) data->bytes, data->len, buf) == -1) {
+	    sprintf(ch->errstr, "Record does not fit the conversion profile");
+	    return (-1);
+	}
+
+	data->len = pp->wire;
+    }
+
+    data->bytes = buf;
+    return (0);
+}
+
+
+/*
+ * Where to receive a body so that cblin() can convert it: the caller's field,
+ * unless the profile has fields, in which case the wire record goes to scratch
+ * and "size" is changed to suit.
+ */
+static char *cblbuf(RMQ_conn_t * ch, char *body, int *size)
+{
+    RMQ_profile_t *pp = (RMQ_profile_t *) ch->cvt;
+
+    if (pp == NULL || pp->nfield == 0) {
+	return (body);
+    }
+
+    *size = pp->wire;
+    return ((char *) cvt_buf(pp, pp->wire));
+}
+
+
+/*
+ * Converts a body received as cblbuf() said into "body", before cblrecv(). If
+ * it does not fit the profile "body" gets the wire record as it came, so that
+ * the caller can see (and still ack or nack) what was sent.
+ */
+static int cblin(RMQ_conn_t * ch, RMQ_info_t * data, char *body, int size)
+{
+    RMQ_profile_t *pp = (RMQ_profile_t *) ch->cvt;
+    size_t n;
+
+    if (pp == NULL) {
+	return (0);
+    }
+
+    if (pp->nfield == 0) {
+	cvt.xlate(pp->e2a, (unsigned char *) body, (unsigned char *) body,
+		  data->data.len <
+		  (size_t) size ? data->data.len : (size_t) size);
+	return (0);
+    }
+
+    if (size < pp->local
+	|| cvt_in(pp, pp->buf, data->data.len, (unsigned char *) body) == -1) {
+	sprintf(ch->errstr, "Message does not fit the conversion profile");
+
+	if ((n = data->data.len) > (size_t) pp->wire) {
+	    n = pp->wire;
+	}
+
+	cblcpy(body, size, pp->buf, n);
+	return (-1);
+    }
+
+    data->data.len = pp->local;
+    return (0);
+}
+
+
 void RMQ_STRERROR(void *handle, char *str, int len)
 {
-    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
-    int n;
-    char *tmp;
+    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
+    int n;
+    char *tmp;
+
+    assert(str);
+
+    tmp = RabbitMQ_strerror(ch);
+
+    if ((n = strlen(tmp)) > len) {
+	n = len;
+    }
+
+    memset(str, ' ', len);
+    memcpy(str, tmp, n);
+}
+
+
+int RMQ_CONNECT(void **handle, char *url, int len)
+{
+    char *tmp;
+
+    assert(handle);
+    assert(url);
+
+    tmp = mkstr(url, len);
+    *handle = (void *) RabbitMQ_connect(tmp);
+    free(tmp);
+
+    return ((*handle) ? 1 : 0);
+}
+
+
+void RMQ_DISCONNECT(void *handle)
+{
+    assert(handle);
+    cvt_free((RMQ_profile_t *) ((RMQ_conn_t *) handle)->cvt);
+    RabbitMQ_disconnect((RMQ_conn_t *) handle);
+}
+
+
+int
+RMQ_PUBLISH(void *handle, char *exch, int exch_len, char *rkey,
+	    int rkey_len, int mand, int immed, char *body, int len,
+	    void *props)
+{
+    amqp_bytes_t data;
+
+    assert(handle);
+    assert(exch);
+    assert(rkey);
+    assert(body);
+
+    data.bytes = body;
+    data.len = (len == -1 ? strlen(body) : (size_t) len);
+
+    if (cblout((RMQ_conn_t *) handle, &data) == -1) {
+	return (0);
+    }
+
+    return (RabbitMQ_publish_bytes((RMQ_conn_t *) handle,
+				   mkbytes(exch, exch_len),
+				   mkbytes(rkey, rkey_len), mand, immed,
+				   props, data) == -1 ? 0 : 1);
+}
+
+
+/*
+ * Sets up a publisher for a loop that sends to the same exchange and routing
+ * key, with the same properties, every time. The exchange and routing key are
+ * trimmed and copied once, here, as are the properties (though not anything
+ * they point to, which must stay put); RMQ_PUBLISH_PREPARED then only has the
+ * body to deal with. Free with RMQ_FREE_PREPARED.
+ */
+int
+RMQ_PREPARE_PUBLISH(void **prep, void *handle, char *exch, int exch_len,
+		    char *rkey, int rkey_len, int mand, int immed,
+		    void *props)
+{
+    RMQ_prepared_t *pp;
+    amqp_bytes_t e;
+    amqp_bytes_t k;
+
+    assert(prep);
+    assert(handle);
+    assert(exch);
+    assert(rkey);
+
+    *prep = NULL;
+    e = mkbytes(exch, exch_len);
+    k = mkbytes(rkey, rkey_len);
+
+    if (e.len > 255 || k.len > 255) {
+	/* Neither can be longer than a short string */
+	sprintf(((RMQ_conn_t *) handle)->errstr,
+		"%s name is longer than 255 bytes",
+		e.len > 255 ? "Exchange" : "Routing key");
+	return (0);
+    }
+
+    RMQ_AllocAssert((pp =
+		     (RMQ_prepared_t *) calloc(1, sizeof(RMQ_prepared_t))));
+
+    pp->ch = (RMQ_conn_t *) handle;
+    memcpy(pp->names, e.bytes, e.len);
+    memcpy(pp->names + 256, k.bytes, k.len);
+    pp->exch.bytes = pp->names;
+    pp->exch.len = e.len;
+    pp->rkey.bytes = pp->names + 256;
+    pp->rkey.len = k.len;
+    pp->mand = mand;
+    pp->immed = immed;
+
+    if (props != NULL) {
+	pp->props = *(amqp_basic_properties_t *) props;
+	pp->pp = &pp->props;
+    }
+
+    *prep = (void *) pp;
+    return (1);
+}
+
+
+int RMQ_PUBLISH_PREPARED(void *prep, char *body, int len)
+{
+    RMQ_prepared_t *pp = (RMQ_prepared_t *) prep;
+    amqp_bytes_t data;
+
+    assert(pp);
+    assert(body);
+
+    data.bytes = body;
+    data.len = (len == -1 ? strlen(body) : (size_t) len);
+
+    if (cblout(pp->ch, &data) == -1) {
+	return (0);
+    }
+
+    return (RabbitMQ_publish_bytes(pp->ch, pp->exch, pp->rkey, pp->mand,
+				   pp->immed, pp->pp, data) == -1 ? 0 : 1);
+}
+
+
+void RMQ_FREE_PREPARED(void *prep)
+{
+    free(prep);
+}
+
+
+/*
+ * Publishes every entry of an OCCURS table ("count" records of "record_len"
+ * bytes) as a message of its own, in one call and with one write to the
+ * socket per few hundred kilobytes. If "tout" is non-zero the handle is put in
+ * confirm mode (if it isn't already) and the call waits up to "tout"
+ * milliseconds (-1 for ever) for the broker to confirm the batch. Returns 1 if
+ * all is well, 2 if the broker nacked any of them, or 0 on error or timeout.
+ */
+int
+RMQ_PUBLISH_TABLE(void *handle, char *exch, int exch_len, char *rkey,
+		  int rkey_len, char *table, int record_len, int count,
+		  void *props, int tout)
+{
+    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
+    RMQ_profile_t *pp;
+    unsigned char *buf;
+    size_t n;
+    int rv;
+    int i;
+
+    assert(handle);
+    assert(exch);
+    assert(rkey);
+    assert(table);
+
+    if (record_len < 0 || count < 0) {
+	sprintf(ch->errstr, "Invalid record length (%d) or count (%d)",
+		record_len, count);
+	return (0);
+    }
+
+    /* Convert the whole table up front, so that nothing is sent if it fails */
+    if ((pp = (RMQ_profile_t *) ch->cvt) != NULL && count > 0) {
+	if (pp->nfield == 0) {
+	    n = (size_t) record_len * count;
+	    buf = cvt_buf(pp, n);
+	    cvt.xlate(pp->a2e, (unsigned char *) table, buf, n);
+	} else {
+	    buf = cvt_buf(pp, (size_t) pp->wire * count);
+
+	    for (i = 0; i < count; i++) {
+		if (cvt_out(pp, (unsigned char *) table + (size_t) i * record_len,
+			    (size_t) record_len,
+			    buf + (size_t) i * pp->wire) == -1) {
+		    sprintf(ch->errstr,
+			    "Entry %d does not fit the conversion profile",
+			    i + 1);
+		    return (0);
+		}
+	    }
+
+	    record_len = pp->wire;
+	}
+
+	table = (char *) buf;
+    }
+
+    if (tout != 0 && RabbitMQ_confirm_select(ch, 0, NULL, NULL) == -1) {
+	return (0);
+    }
+
+    /* One timeout for the whole batch, including waits for room to send */
+    if (tout != 0) {
+	RabbitMQ_confirm_deadline(ch, tout);
+    }
+
+    rv = RabbitMQ_publish_table(ch, mkbytes(exch, exch_len),
+				mkbytes(rkey, rkey_len), 0, 0, props, table,
+				(size_t) record_len, count);
+
+    if (tout == 0) {
+	return (rv == -1 ? 0 : 1);
+    }
+
+    if (rv != -1) {
+	rv = RabbitMQ_confirm_wait(ch, -1);
+    }
+
+    RabbitMQ_confirm_deadline(ch, -1);
+
+    if (rv == -1) {
+	return (0);
+    }
+
+    return (rv == 1 ? 2 : 1);
+}
+
+
+/*
+ * Starts consuming from a queue. The consumer tag the broker settled on is
+ * returned in "ctag" (space-padded, "ctag_len" set to its length) if there is
+ * somewhere to put it. Deliveries are then picked up with RMQ_DEQUEUE.
+ */
+int
+RMQ_CONSUME(void *handle, char *queue, int qlen, char *ctag,
+	    int *ctag_len, int no_ack, int exclsve)
+{
+    char *q_tmp;
+    char *tmp;
+
+    assert(handle);
+    assert(queue);
+
+    q_tmp = mkstr(queue, qlen);
+    tmp = RabbitMQ_consume((RMQ_conn_t *) handle, q_tmp, NULL, 0, no_ack,
+			   exclsve, NULL);
+    free(q_tmp);
+
+    if (tmp == NULL) {
+	return (0);
+    }
+
+    if (ctag && ctag_len && *ctag_len) {
+	cblcpy(ctag, *ctag_len, tmp, strlen(tmp));
+	*ctag_len = strlen(tmp);
+    }
+
+    free(tmp);
+    return (1);
+}
+
+
+/*
+ * Receiving. RMQ_DEQUEUE (after RMQ_CONSUME) and RMQ_GET put the body straight
+ * into "body", a PIC X field of "size" bytes, space-padding what is left;
+ * "len" is set to the full length of the message. The routing key and
+ * correlation ID are copied (space-padded) into their fields if given, and the
+ * delivery tag (PIC 9(18) COMP-5) is what RMQ_ACK or RMQ_NACK need unless
+ * "no_ack" was set. Nothing is allocated per message. Returns 1 for a message,
+ * 0 on error, 2 if nothing came within "tout" milliseconds (RMQ_DEQUEUE; -1
+ * waits indefinitely) or the queue was empty (RMQ_GET), 3 if the body did not
+ * fit (the first "size" bytes are kept), and 4 if it did not fit the handle's
+ * conversion profile (see RMQ_PROFILE): the body is then left as it came and
+ * the delivery tag is set, so that the message can be nacked.
+ */
+static int
+cblrecv(RMQ_info_t * data, char *body, int size, int *len, char *rkey,
+	int rkey_len, char *cid, int cid_len, uint64_t * dtag)
+{
+    int rv;
+
+    if (data->data.len < (size_t) size) {
+	memset(body + data->data.len, ' ', size - data->data.len);
+    }
+
+    if (len != NULL) {
+	*len = (int) data->data.len;
+    }
+
+    cblcpy(rkey, rkey_len, data->rkey,
+	   data->rkey == NULL ? 0 : strlen(data->rkey));
+    cblcpy(cid, cid_len, data->cid,
+	   data->cid == NULL ? 0 : strlen(data->cid));
+
+    if (dtag != NULL) {
+	*dtag = data->dtag;
+    }
+
+    rv = (data->flags & RMQ_INFO_TRUNCATED ? 3 : 1);
+    RabbitMQ_info_init(data);
+    return (rv);
+}
+
+
+int
+RMQ_DEQUEUE(void *handle, char *body, int size, int *len, char *rkey,
+	    int rkey_len, char *cid, int cid_len, uint64_t * dtag,
+	    int no_ack, int tout)
+{
+    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
+    RMQ_info_t data;
+    uint64_t tag;
+    char *buf;
+    int bsize = size;
+    int rv;
+
+    assert(handle);
+    assert(body);
+
+    buf = cblbuf(ch, body, &bsize);
+    rv = RabbitMQ_dequeue_wait(ch, &data, &tag, no_ack, buf, (size_t) bsize,
+			       tout);
+
+    if (rv == -1) {
+	return (0);
+    } else if (rv == 1) {
+	return (2);
+    }
+
+    if (cblin(ch, &data, body, size) == -1) {
+	cblrecv(&data, body, size, len, rkey, rkey_len, cid, cid_len, dtag);
+	return (4);
+    }
+
+    return (cblrecv(&data, body, size, len, rkey, rkey_len, cid, cid_len,
+		    dtag));
+}
+
+
+int
+RMQ_GET(void *handle, char *queue, int qlen, char *body, int size,
+	int *len, char *rkey, int rkey_len, char *cid, int cid_len,
+	uint64_t * dtag, int no_ack)
+{
+    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
+    RMQ_info_t data;
+    char q_tmp[256];
+    char *buf;
+    int bsize = size;
+
+    assert(handle);
+    assert(queue);
+    assert(body);
+
+    /* Queue names are short strings, so no need for mkstr() */
+    if (shortstr(ch, q_tmp, queue, qlen) == -1) {
+	return (0);
+    }
+
+    buf = cblbuf(ch, body, &bsize);
+
+    if (RabbitMQ_get_into(ch, q_tmp, &data, no_ack, buf,
+			  (size_t) bsize) == -1) {
+	return (0);
+    }
+
+    if (data.data.bytes == NULL) {
+	return (2);		/* Queue was empty */
+    }
+
+    if (cblin(ch, &data, body, size) == -1) {
+	cblrecv(&data, body, size, len, rkey, rkey_len, cid, cid_len, dtag);
+	return (4);
+    }
+
+    return (cblrecv(&data, body, size, len, rkey, rkey_len, cid, cid_len,
+		    dtag));
+}
+
+
+/*
+ * RMQ_DEQUEUE for a whole OCCURS table at once: fills up to "max" entries of
+ * "record_len" bytes each (space-padded) with whatever has been received or
+ * arrives within "tout" milliseconds, and sets "count" to how many. "lens" and
+ * "dtags" are parallel tables (PIC S9(9) COMP-5 and PIC 9(18) COMP-5) of the
+ * full message lengths and the delivery tags; a length over "record_len" means
+ * that entry was cut short. RMQ_ACK of the last tag with "multiple" set
+ * acknowledges the lot. Returns 1 if any entries were filled, 2 if nothing
+ * came in time, or 0 on error. With a conversion profile, an entry that does
+ * not fit it is left as it came (see RMQ_DEQUEUE) with its length negated, the
+ * rest are converted as usual, and the call returns 4, so that the bad ones
+ * can be picked out and nacked.
+ */
+int
+RMQ_RECEIVE_TABLE(void *handle, char *table, int record_len, int max,
+		  int *count, int *lens, uint64_t * dtags, int no_ack,
+		  int tout)
+{
+    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
+    RMQ_profile_t *pp = (RMQ_profile_t *) ch->cvt;
+    unsigned char *buf = (unsigned char *) table;
+    int wire = record_len;
+    char *rec;
+    int bad = 0;
+    int len;
+    int n;
+    int i;
+
+    assert(handle);
+    assert(table);
+    assert(lens);
+
+    /* A profile with fields means receiving wire records into scratch */
+    if (pp != NULL && pp->nfield != 0) {
+	if (record_len < pp->local) {
+	    sprintf(ch->errstr, "Entries are shorter than the local record");
+	    return (0);
+	}
+
+	wire = pp->wire;
+	buf = cvt_buf(pp, (size_t) wire * (max > 0 ? max : 0));
+    }
+
+    n = RabbitMQ_dequeue_table(ch, (char *) buf, (size_t) wire, max, lens,
+			       dtags, no_ack, tout);
+
+    if (count != NULL) {
+	*count = (n > 0 ? n : 0);
+    }
+
+    if (n == -1) {
+	return (0);
+    }
+
+    for (i = 0; i < n; i++) {
+	rec = table + i * record_len;
+
+	if (pp != NULL && pp->nfield != 0) {
+	    if (cvt_in(pp, buf + (size_t) i * wire, (size_t) lens[i],
+		       (unsigned char *) rec) == -1) {
+		if (bad++ == 0) {
+		    sprintf(ch->errstr,
+			    "Entry %d does not fit the conversion profile",
+			    i + 1);
+		}
+
+		cblcpy(rec, record_len, buf + (size_t) i * wire,
+		       lens[i] < wire ? (size_t) lens[i] : (size_t) wire);
+		lens[i] = -lens[i];
+		continue;
+	    }
+
+	    lens[i] = pp->local;
+	} else if (pp != NULL) {
+	    cvt.xlate(pp->e2a, (unsigned char *) rec, (unsigned char *) rec,
+		      lens[i] < record_len ? lens[i] : record_len);
+	}
+
+	if ((len = lens[i]) < record_len) {
+	    memset(rec + len, ' ', record_len - len);
+	}
+    }
+
+    if (bad != 0) {
+	return (4);
+    }
+
+    return (n == 0 ? 2 : 1);
+}
+
+
+int RMQ_ACK(void *handle, uint64_t dtag, int multiple)
+{
+    assert(handle);
+    return (RabbitMQ_ack((RMQ_conn_t *) handle, dtag, multiple) ==
+	    -1 ? 0 : 1);
+}
+
+
+int RMQ_NACK(void *handle, uint64_t dtag, int multiple, int requeue)
+{
+    assert(handle);
+    return (RabbitMQ_nack((RMQ_conn_t *) handle, dtag, multiple, requeue)
+	    == -1 ? 0 : 1);
+}
+
+
+void RMQ_DUMP(char *addr, int len)
+{
+    assert(addr);
+    RabbitMQ_dump(addr, len);
+}
+
+
+int RMQ_ALLOC(void **info)
+{
+    assert(info);
+
+    if ((*info = (RMQ_info_t *) RabbitMQ_alloc_info()) != NULL) {
+	return (1);
+    } else {
+	return (0);
+    }
+}
+
+
+/*
+ * Asynchronous RPC. RMQ_RPC_SEND publishes a request and sets "call" (USAGE
+ * POINTER) to stand for its reply; several can be outstanding at once.
+ * RMQ_RPC_WAIT waits up to "tout" milliseconds (-1 for ever) for the reply to
+ * one of them, RMQ_RPC_WAIT_ANY for the first reply to any of "n" (an OCCURS
+ * table of pointers, unused entries NULL), setting "idx" to its subscript
+ * (from 1). The reply goes into "repl", a field of "size" bytes, with only the
+ * unused tail space-padded; "repl_len" is set to the full length of the reply.
+ * Both return 1 for a reply, 3 if it did not fit (the first "size" bytes are
+ * kept), 4 if it did not fit the conversion profile (it is then returned as it
+ * came, as for RMQ_DEQUEUE), 2 on timeout (the calls can be waited on again)
+ * and 0 on error. The pointer for an answered call is set to NULL; one that is
+ * no longer wanted should be given to RMQ_RPC_CANCEL.
+ */
+static int
+cblreply(RMQ_conn_t * ch, RMQ_info_t * data, char *repl, int size,
+	 int *repl_len)
+{
+    RMQ_profile_t *pp = (RMQ_profile_t *) ch->cvt;
+    size_t len = data->data.len;
+
+    if (pp != NULL && pp->nfield != 0) {
+	if (size < pp->local
+	    || cvt_in(pp, (unsigned char *) data->data.bytes, len,
+		      (unsigned char *) repl) == -1) {
+	    sprintf(ch->errstr, "Reply does not fit the conversion profile");
+	    cblcpy(repl, size, data->data.bytes, len);
+
+	    if (repl_len != NULL) {
+		*repl_len = (int) len;
+	    }
+
+	    RabbitMQ_info_init(data);
+	    return (4);
+	}
 
-    assert(str);
+	len = pp->local;
+	cblcpy(repl + len, size - (int) len, NULL, 0);
+    } else {
+	cblcpy(repl, size, data->data.bytes, len);
 
-    tmp = RabbitMQ_strerror(ch);
+	if (pp != NULL) {
+	    cvt.xlate(pp->e2a, (unsigned char *) repl, (unsigned char *) repl,
+		      len < (size_t) size ? len : (size_t) size);
+	}
+    }
 
-    if ((n = strlen(tmp)) > len) {
-	n = len;
+    if (repl_len != NULL) {
+	*repl_len = (int) len;
     }
 
-    memset(str, ' ', len);
-    memcpy(str, tmp, n);
+    RabbitMQ_info_init(data);
+    return (len > (size_t) size ? 3 : 1);
 }
 
 
-int RMQ_CONNECT(void **handle, char *url, int len)
+int
+RMQ_RPC_SEND(void **call, void *handle, char *exch, int exch_len,
+	     char *rkey, int rkey_len, char *rqst, int rqst_len)
 {
-    char *tmp;
+    amqp_bytes_t data;
+    char e_tmp[256];
+    char k_tmp[256];
 
+    assert(call);
     assert(handle);
-    assert(url);
+    assert(exch);
+    assert(rkey);
+    assert(rqst);
 
-    tmp = mkstr(url, len);
-    *handle = (void *) RabbitMQ_connect(tmp);
-    free(tmp);
+    *call = NULL;
 
-    return ((*handle) ? 1 : 0);
-}
+    if (shortstr((RMQ_conn_t *) handle, e_tmp, exch, exch_len) == -1
+	|| shortstr((RMQ_conn_t *) handle, k_tmp, rkey, rkey_len) == -1) {
+	return (0);
+    }
 
+    data.bytes = rqst;
+    data.len = (rqst_len == -1 ? strlen(rqst) : (size_t) rqst_len);
 
-void RMQ_DISCONNECT(void *handle)
-{
-    assert(handle);
-    RabbitMQ_disconnect((RMQ_conn_t *) handle);
+    if (cblout((RMQ_conn_t *) handle, &data) == -1) {
+	return (0);
+    }
+
+    *call = (void *) RabbitMQ_rpc_send((RMQ_conn_t *) handle, e_tmp, k_tmp,
+				       (char *) data.bytes, (int) data.len);
+
+    return (*call == NULL ? 0 : 1);
 }
 
 
 int
-RMQ_PUBLISH(void *handle, char *exch, int exch_len, char *rkey,
-	    int rkey_len, int mand, int immed, char *body, int len,
-	    void *props)
+RMQ_RPC_WAIT(void *handle, void **call, char *repl, int size,
+	     int *repl_len, int tout)
 {
-    char *exch_tmp;
-    char *rkey_tmp;
+    RMQ_info_t data;
     int rv;
 
     assert(handle);
-    assert(exch);
-    assert(rkey);
-    assert(body);
+    assert(call);
+    assert(*call);
+    assert(repl);
 
-    exch_tmp = mkstr(exch, exch_len);
-    rkey_tmp = mkstr(rkey, rkey_len);
+    rv = RabbitMQ_rpc_wait((RMQ_conn_t *) handle, (RMQ_rpc_t *) * call,
+			   &data, tout);
 
-    rv = RabbitMQ_publish((RMQ_conn_t *) handle, exch_tmp, rkey_tmp, mand,
-			  immed, props, body, len);
-    free(exch_tmp);
-    free(rkey_tmp);
+    if (rv == -1) {
+	return (0);
+    } else if (rv == 1) {
+	return (2);
+    }
 
-    return (rv == -1 ? 0 : 1);
+    *call = NULL;
+    return (cblreply((RMQ_conn_t *) handle, &data, repl, size, repl_len));
 }
 
 
-void RMQ_DUMP(char *addr, int len)
+int
+RMQ_RPC_WAIT_ANY(void *handle, void **calls, int n, char *repl, int size,
+		 int *repl_len, int *idx, int tout)
 {
-    assert(addr);
-    RabbitMQ_dump(addr, len);
-}
+    RMQ_info_t data;
+    int i;
+    int rv;
 
+    assert(handle);
+    assert(calls);
+    assert(repl);
 
-int RMQ_ALLOC(void **info)
-{
-    assert(info);
+    rv = RabbitMQ_rpc_wait_any((RMQ_conn_t *) handle, (RMQ_rpc_t **) calls,
+			       n, &data, tout, &i);
 
-    if ((*info = (RMQ_info_t *) RabbitMQ_alloc_info()) != NULL) {
-	return (1);
-    } else {
+    if (rv == -1) {
 	return (0);
+    } else if (rv == 1) {
+	return (2);
+    }
+
+    if (idx != NULL) {
+	*idx = i + 1;
     }
+
+    return (cblreply((RMQ_conn_t *) handle, &data, repl, size, repl_len));
+}
+
+
+void RMQ_RPC_CANCEL(void *handle, void **call)
+{
+    assert(handle);
+    assert(call);
+
+    RabbitMQ_rpc_cancel((RMQ_conn_t *) handle, (RMQ_rpc_t *) * call);
+    *call = NULL;
 }
 
 
+/*
+ * A single blocking call; "repl_len" gives the size of "repl" on the way in.
+ * Returns as RMQ_RPC_WAIT.
+ */
 int
 RMQ_RPC_CALL(void *handle, char *exch, int exch_len, char *rkey,
 	     int rkey_len, char *rqst, int rqst_len, void *repl,
 	     int *repl_len)
 {
-    char *exch_tmp;
-    char *rkey_tmp;
+    void *call;
     int rv;
-    RMQ_info_t data;
 
-    assert(handle);
-    assert(exch);
-    assert(rkey);
-    assert(rqst);
     assert(repl);
     assert(repl_len);
 
-    memset(&data, '\0', sizeof(data));
+    if (RMQ_RPC_SEND(&call, handle, exch, exch_len, rkey, rkey_len, rqst,
+		     rqst_len) == 0) {
+	return (0);
+    }
 
-    exch_tmp = mkstr(exch, exch_len);
-    rkey_tmp = mkstr(rkey, rkey_len);
+    if ((rv = RMQ_RPC_WAIT(handle, &call, (char *) repl, *repl_len,
+			   repl_len, -1)) == 0) {
+	RMQ_RPC_CANCEL(handle, &call);
+    }
 
-    rv = RabbitMQ_rpc_call((RMQ_conn_t *) handle, exch_tmp, rkey_tmp, rqst,
-			   rqst_len, &data);
+    return (rv);
+}
 
-    free(exch_tmp);
-    free(rkey_tmp);
 
-    if (rv == -1) {
-	return (0);
+/*
+ * Returns the handle's statistics as up to "n" 64-bit binary values (for example
+ * PIC S9(18) COMP-5 OCCURS 16), in this order: publishes, bytes published,
+ * deliveries, bytes delivered, frames received, acks sent, RPC requests, then
+ * the RPC round trip p50, p99, p999 and maximum, and the same four for the time
+ * spent waiting for frames (all latencies in microseconds). Returns the number
+ * of values stored.
+ */
+int RMQ_STATS(void *handle, long long *vals, int n, int reset)
+{
+    RMQ_stats_t *sp;
+    long long tmp[15];
+    int i;
+
+    assert(handle);
+    assert(vals);
+
+    RMQ_AllocAssert((sp = (RMQ_stats_t *) malloc(sizeof(RMQ_stats_t))));
+    RabbitMQ_stats((RMQ_conn_t *) handle, sp, reset);
+
+    tmp[0] = sp->publishes;
+    tmp[1] = sp->publish_bytes;
+    tmp[2] = sp->deliveries;
+    tmp[3] = sp->delivery_bytes;
+    tmp[4] = sp->frames;
+    tmp[5] = sp->acks;
+    tmp[6] = sp->rpcs;
+    tmp[7] = RabbitMQ_percentile(&sp->rpc, 50.0);
+    tmp[8] = RabbitMQ_percentile(&sp->rpc, 99.0);
+    tmp[9] = RabbitMQ_percentile(&sp->rpc, 99.9);
+    tmp[10] = sp->rpc.max;
+    tmp[11] = RabbitMQ_percentile(&sp->wait, 50.0);
+    tmp[12] = RabbitMQ_percentile(&sp->wait, 99.0);
+    tmp[13] = RabbitMQ_percentile(&sp->wait, 99.9);
+    tmp[14] = sp->wait.max;
+    free(sp);
+
+    for (i = 0; i < n && i < 15; i++) {
+	vals[i] = tmp[i];
     }
 
-    if (data.data.len > *repl_len) {
-	// Problem (TBD)
+    return (i);
+}
 
-	return (0);
-    }
 
+int RMQ_RPC_DIRECT(void *handle, int flag)
+{
+    assert(handle);
+    return (RabbitMQ_rpc_direct((RMQ_conn_t *) handle, flag) ==
+	    -1 ? 0 : 1);
+}
+
+
+/*
+ * Turns on failover (see RabbitMQ_failover()); "urls" is a comma-separated list
+ * of brokers. Call it straight after RMQ_CONNECT.
+ */
+int RMQ_FAILOVER(void *handle, char *urls, int len)
+{
+    char *tmp;
+    int rv;
+
+    assert(handle);
+    assert(urls);
+
+    tmp = mkstr(urls, len);
+    rv = RabbitMQ_failover((RMQ_conn_t *) handle, tmp);
+    free(tmp);
+
+    return (rv == -1 ? 0 : 1);
+}
 
-    memset(repl, '\0', *repl_len);	// Why '\0' ?? (TBD)
-    memcpy(repl, data.data.bytes, data.data.len);
-    *repl_len = data.data.len;
 
-    RabbitMQ_info_init(&data);
+/*
+ * Pipeline mode (see RabbitMQ_pipeline()): declares and binds made between
+ * RMQ_PIPELINE with flag 1 and RMQ_SYNC (or RMQ_PIPELINE with flag 0) don't
+ * wait for the broker; any error is returned by the RMQ_SYNC.
+ */
+int RMQ_PIPELINE(void *handle, int flag)
+{
+    assert(handle);
+    return (RabbitMQ_pipeline((RMQ_conn_t *) handle, flag) == -1 ? 0 : 1);
+}
 
-    return (1);
+
+int RMQ_SYNC(void *handle)
+{
+    assert(handle);
+    return (RabbitMQ_sync((RMQ_conn_t *) handle) == -1 ? 0 : 1);
+}
+
+
+int RMQ_TOPOLOGY_CACHE(void *handle, int flag)
+{
+    assert(handle);
+    return (RabbitMQ_topology_cache((RMQ_conn_t *) handle, flag) ==
+	    -1 ? 0 : 1);
+}
+
+
+#if !defined(__VMS) && !defined(_WIN32)
+/*
+ * Spool mode (see RabbitMQ_spool()): RMQ_PUBLISH appends to a ring in the file
+ * "path" (of "size" bytes, or the default if 0) and returns at once unless it is
+ * full; a thread sends the messages on. RMQ_SPOOL_FLUSH waits up to "tout"
+ * milliseconds (forever if negative) for the broker to confirm them all.
+ */
+int RMQ_SPOOL(void *handle, char *path, int len, int size)
+{
+    char *tmp;
+    int rv;
+
+    assert(handle);
+    assert(path);
+
+    tmp = mkstr(path, len);
+    rv = RabbitMQ_spool((RMQ_conn_t *) handle, tmp,
+			(size_t) (size < 0 ? 0 : size));
+    free(tmp);
+
+    return (rv == -1 ? 0 : 1);
+}
+
+
+int RMQ_SPOOL_FLUSH(void *handle, int tout)
+{
+    assert(handle);
+    return (RabbitMQ_spool_flush((RMQ_conn_t *) handle, tout) ==
+	    -1 ? 0 : 1);
 }
+#endif
 
 
 int
@@ -376,3 +2051,201 @@ void RMQ_PROPS_SET(void *pp, int opt, void *val, int size)
 	break;
     }
 }
+
+
+/*
+ * Conversion of single fields (see cvt_init()). "ccsid" is the EBCDIC code
+ * page, 37 or 500 (0 for 37); "ebcdic" says whether zoned decimal is EBCDIC
+ * (zones F, sign C or D) or as GnuCOBOL keeps it (zones 3, sign 7 for minus);
+ * binary values are PIC S9(18) COMP-5, unscaled. All return 1, or 0 if the
+ * data is not valid, the value does not fit or the length is out of range.
+ */
+int RMQ_EBCDIC_TO_ASCII(char *src, char *dst, int len, int ccsid)
+{
+    int i;
+
+    assert(src);
+    assert(dst);
+
+    if (len < 0 || (i = cvt_page(ccsid)) == -1) {
+	return (0);
+    }
+
+    cvt.xlate(cvt_pages[i].e2a, (unsigned char *) src, (unsigned char *) dst,
+	      (size_t) len);
+    return (1);
+}
+
+
+int RMQ_ASCII_TO_EBCDIC(char *src, char *dst, int len, int ccsid)
+{
+    int i;
+
+    assert(src);
+    assert(dst);
+
+    if (len < 0 || (i = cvt_page(ccsid)) == -1) {
+	return (0);
+    }
+
+    cvt.xlate(cvt_pages[i].a2e, (unsigned char *) src, (unsigned char *) dst,
+	      (size_t) len);
+    return (1);
+}
+
+
+int RMQ_PACKED_TO_BINARY(char *src, int len, long long *val)
+{
+    int64_t v;
+
+    assert(src);
+    assert(val);
+
+    if (len < 1 || len > RMQ_MAX_PACKED
+	|| unpack_c((unsigned char *) src, len, &v) == -1) {
+	return (0);
+    }
+
+    *val = (long long) v;
+    return (1);
+}
+
+
+int RMQ_BINARY_TO_PACKED(long long val, char *dst, int len)
+{
+    assert(dst);
+
+    if (len < 1 || len > RMQ_MAX_PACKED) {
+	return (0);
+    }
+
+    return (cvt.pack((int64_t) val, (unsigned char *) dst, len) ==
+	    -1 ? 0 : 1);
+}
+
+
+int RMQ_ZONED_TO_BINARY(char *src, int len, int ebcdic, long long *val)
+{
+    int64_t v;
+
+    assert(src);
+    assert(val);
+
+    if (len < 1 || len > RMQ_MAX_ZONED
+	|| unzone_c((unsigned char *) src, len, ebcdic, &v) == -1) {
+	return (0);
+    }
+
+    *val = (long long) v;
+    return (1);
+}
+
+
+int RMQ_BINARY_TO_ZONED(long long val, char *dst, int len, int ebcdic)
+{
+    assert(dst);
+
+    if (len < 1 || len > RMQ_MAX_ZONED) {
+	return (0);
+    }
+
+    return (cvt.zone((int64_t) val, (unsigned char *) dst, len, ebcdic) ==
+	    -1 ? 0 : 1);
+}
+
+
+/*
+ * Attaches a conversion profile to the handle, replacing any it had; a
+ * "ccsid" of -1 just removes it. From then on RMQ_PUBLISH,
+ * RMQ_PUBLISH_PREPARED, RMQ_PUBLISH_TABLE and the RPC calls convert what they
+ * send, and RMQ_DEQUEUE, RMQ_GET, RMQ_RECEIVE_TABLE and the RPC waits what
+ * they receive. Without fields the whole body is text in code page "ccsid".
+ * RMQ_PROFILE_FIELD adds a field: "type" is 1 for text, 2 for packed decimal,
+ * 3 for EBCDIC zoned decimal and 4 for bytes copied as they are. Positions
+ * count from 1, as in reference modification; numbers are COMP-5 of 1, 2, 4
+ * or 8 bytes here. Messages are then fixed-length records, as long as the
+ * furthest field on either side; one received that is too short or holds a
+ * bad number is returned unconverted, with status 4 (see RMQ_DEQUEUE).
+ */
+int RMQ_PROFILE(void *handle, int ccsid)
+{
+    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
+    RMQ_profile_t *pp;
+    int i;
+
+    assert(handle);
+
+    if (ccsid == -1) {
+	cvt_free((RMQ_profile_t *) ch->cvt);
+	ch->cvt = NULL;
+	return (1);
+    }
+
+    if ((i = cvt_page(ccsid)) == -1) {
+	sprintf(ch->errstr, "Code page %d is not supported", ccsid);
+	return (0);
+    }
+
+    RMQ_AllocAssert((pp =
+		     (RMQ_profile_t *) calloc(1, sizeof(RMQ_profile_t))));
+
+    pp->e2a = cvt_pages[i].e2a;
+    pp->a2e = cvt_pages[i].a2e;
+
+    cvt_free((RMQ_profile_t *) ch->cvt);
+    ch->cvt = (void *) pp;
+    return (1);
+}
+
+
+int
+RMQ_PROFILE_FIELD(void *handle, int type, int wire_pos, int wire_len,
+		  int local_pos, int local_len)
+{
+    RMQ_conn_t *ch = (RMQ_conn_t *) handle;
+    RMQ_profile_t *pp;
+    RMQ_field_t *fp;
+
+    assert(handle);
+
+    if ((pp = (RMQ_profile_t *) ch->cvt) == NULL) {
+	sprintf(ch->errstr, "No conversion profile (see RMQ_PROFILE)");
+	return (0);
+    }
+
+    if (type < RMQ_FIELD_TEXT || type > RMQ_FIELD_COPY || wire_pos < 1
+	|| wire_len < 1 || local_pos < 1 || local_len < 1
+	|| (type == RMQ_FIELD_PACKED && wire_len > RMQ_MAX_PACKED)
+	|| (type == RMQ_FIELD_ZONED && wire_len > RMQ_MAX_ZONED)
+	|| ((type == RMQ_FIELD_PACKED || type == RMQ_FIELD_ZONED)
+	    && local_len != 1 && local_len != 2 && local_len != 4
+	    && local_len != 8)) {
+	sprintf(ch->errstr, "Invalid conversion field");
+	return (0);
+    }
+
+    if (pp->nfield % 16 == 0) {
+	RMQ_AllocAssert((pp->fields =
+			 (RMQ_field_t *) realloc(pp->fields,
+						 (pp->nfield +
+						  16) *
+						 sizeof(RMQ_field_t))));
+    }
+
+    fp = &pp->fields[pp->nfield++];
+    fp->type = type;
+    fp->woff = wire_pos - 1;
+    fp->wlen = wire_len;
+    fp->loff = local_pos - 1;
+    fp->llen = local_len;
+
+    if (fp->woff + fp->wlen > pp->wire) {
+	pp->wire = fp->woff + fp->wlen;
+    }
+
+    if (fp->loff + fp->llen > pp->local) {
+	pp->local = fp->loff + fp->llen;
+    }
+
+    return (1);
+}
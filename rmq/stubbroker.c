@@ -0,0 +1,1798 @@
+/*
+ *
+ * Copyright (c) 2021, Brett Cameron
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * A small in-memory AMQP 0-9-1 broker, good enough to drive librmq (and the
+ * bench program) over loopback without a RabbitMQ installation. It handles the
+ * subset of the protocol the library uses: connection and channel setup,
+ * exchange and queue declare/bind/unbind/purge/delete, qos (prefetch count
+ * only), consume/cancel, publish, get, ack/nack/reject, publisher confirms,
+ * direct reply-to, and tx (which is accepted but not transactional). Default,
+ * direct, fanout and topic exchanges are supported, although topic patterns
+ * only understand exact keys and a lone "#". Nothing is persisted, there is no
+ * authentication, mandatory/immediate are ignored, and messages that do not
+ * route anywhere are dropped.
+ *
+ * Publishing to the default exchange with routing key "rmq.echo" sends the
+ * message straight back to its reply_to address with the same properties,
+ * which is what the RPC benchmark calls.
+ *
+ * Frames are decoded using librabbitmq's own codec (amqp_handle_input()) and
+ * encoded with amqp_encode_method()/amqp_encode_properties(). Each connection
+ * has a reader thread and a writer thread; all broker state is protected by a
+ * single mutex, which is fine for a test tool.
+ *
+ * Built standalone (stubbroker [-p port]) it listens on the loopback
+ * interface, port 5672 by default. Compiled with -DRMQ_STUB_EMBED the main()
+ * is left out and RMQ_stub_start() can be used to run it inside another
+ * program.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#define STUB_PORT	5672
+#define STUB_MAX_CHAN	256
+#define STUB_FRAME_MAX	131072
+#define STUB_ECHO	"rmq.echo"
+#define STUB_REPLY_TO	"amq.rabbitmq.reply-to"
+
+#define STUB_LOCK()	pthread_mutex_lock(&stub.mutex)
+#define STUB_UNLOCK()	pthread_mutex_unlock(&stub.mutex)
+
+typedef struct stub_msg_ {
+    struct stub_msg_ *next;
+    amqp_bytes_t exchange;
+    amqp_bytes_t rkey;
+    amqp_bytes_t props;		/* Encoded property list */
+    amqp_bytes_t body;
+    int redelivered;
+} stub_msg_t;
+
+struct stub_queue_;
+struct stub_chan_;
+struct stub_conn_;
+
+typedef struct stub_cons_ {
+    struct stub_cons_ *next;
+    struct stub_queue_ *q;
+    struct stub_chan_ *cp;
+    amqp_bytes_t tag;
+    int no_ack;
+} stub_cons_t;
+
+typedef struct stub_queue_ {
+    struct stub_queue_ *next;
+    amqp_bytes_t name;
+    stub_msg_t *head;
+    stub_msg_t *tail;
+    uint32_t count;
+    stub_cons_t *cons;		/* Consumers, served round-robin */
+    unsigned long routed;	/* Last route() that picked it */
+} stub_queue_t;
+
+typedef struct stub_exch_ {
+    struct stub_exch_ *next;
+    amqp_bytes_t name;
+    int type;
+} stub_exch_t;
+
+#define STUB_DIRECT	0
+#define STUB_FANOUT	1
+#define STUB_TOPIC	2
+
+typedef struct stub_bind_ {
+    struct stub_bind_ *next;
+    amqp_bytes_t exchange;
+    amqp_bytes_t rkey;
+    stub_queue_t *q;
+} stub_bind_t;
+
+typedef struct stub_unack_ {
+    struct stub_unack_ *next;
+    uint64_t tag;
+    stub_msg_t *mp;
+    stub_queue_t *q;
+} stub_unack_t;
+
+typedef struct stub_chan_ {
+    struct stub_conn_ *cp;
+    int id;
+    int open;
+    int confirm;
+    uint64_t seq;		/* Last publish sequence number (confirms) */
+    int prefetch;
+    int unacked;
+    stub_unack_t *head;		/* Unacknowledged deliveries, in tag order */
+    stub_unack_t *tail;
+    uint64_t tag;		/* Last delivery tag */
+    int state;			/* Content being received (below) */
+    amqp_bytes_t exchange;
+    amqp_bytes_t rkey;
+    amqp_bytes_t props;
+    uint64_t size;
+    uint64_t got;
+    char *body;
+} stub_chan_t;
+
+#define STUB_IDLE	0
+#define STUB_HEADER	1
+#define STUB_BODY	2
+
+typedef struct stub_conn_ {
+    struct stub_conn_ *next;
+    int fd;
+    int id;
+    amqp_connection_state_t state;
+    pthread_mutex_t mutex;	/* Protects the output buffer */
+    pthread_cond_t cond;
+    char *out;
+    size_t used;
+    size_t size;
+    int closing;
+    uint32_t frame_max;
+    char *scratch;		/* Encoding buffer (reader thread only) */
+    char reply[64];		/* Direct reply-to address */
+    stub_chan_t *reply_cp;
+    amqp_bytes_t reply_tag;
+    pthread_t writer;
+    stub_chan_t chans[STUB_MAX_CHAN + 1];
+} stub_conn_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    stub_queue_t *queues;
+    stub_exch_t *exchs;
+    stub_bind_t *binds;
+    stub_conn_t *conns;
+    int ids;
+    int lfd;
+    unsigned long routes;	/* Calls to route() */
+} stub = {
+PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, NULL, 0, -1, 0};
+
+/* ------------------------------------------------------------------------------------------------------- */
+
+static void *xmalloc(size_t len)
+{
+    void *ptr;
+
+    if ((ptr = malloc(len == 0 ? 1 : len)) == NULL) {
+	fprintf(stderr, "stubbroker: out of memory\n");
+	abort();
+    }
+
+    return (ptr);
+}
+
+
+static amqp_bytes_t dupbytes(amqp_bytes_t src)
+{
+    amqp_bytes_t dst;
+
+    dst.len = src.len;
+    dst.bytes = xmalloc(src.len);
+    memcpy(dst.bytes, src.bytes, src.len);
+    return (dst);
+}
+
+
+static amqp_bytes_t dupstr(const char *str)
+{
+    return (dupbytes(amqp_cstring_bytes((char *) str)));
+}
+
+
+static int sameb(amqp_bytes_t a, amqp_bytes_t b)
+{
+    return (a.len == b.len && memcmp(a.bytes, b.bytes, a.len) == 0);
+}
+
+
+static int samestr(amqp_bytes_t a, const char *str)
+{
+    return (a.len == strlen(str) && memcmp(a.bytes, str, a.len) == 0);
+}
+
+
+static void msg_free(stub_msg_t * mp)
+{
+    free(mp->exchange.bytes);
+    free(mp->rkey.bytes);
+    free(mp->props.bytes);
+    free(mp->body.bytes);
+    free(mp);
+}
+
+
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+
+static void put64(unsigned char *p, uint64_t v)
+{
+    put32(p, v >> 32);
+    put32(p + 4, v);
+}
+
+/* ------------------------------------------------------------------------------------------------------- */
+
+/* Output: frames are appended to the connection's buffer and written by its writer thread */
+
+static void out_frame(stub_conn_t * cp, int type, int chan,
+		      const void *payload, size_t len)
+{
+    unsigned char *p;
+
+    if (cp->used + len + 8 > cp->size) {
+	while (cp->used + len + 8 > cp->size) {
+	    cp->size = cp->size ? cp->size * 2 : 65536;
+	}
+
+	if ((cp->out = realloc(cp->out, cp->size)) == NULL) {
+	    fprintf(stderr, "stubbroker: out of memory\n");
+	    abort();
+	}
+    }
+
+    p = (unsigned char *) cp->out + cp->used;
+    p[0] = type;
+    put16(p + 1, chan);
+    put32(p + 3, len);
+    memcpy(p + 7, payload, len);
+    p[7 + len] = AMQP_FRAME_END;
+    cp->used += len + 8;
+}
+
+
+/* Caller must hold cp->mutex */
+static void out_method(stub_conn_t * cp, int chan, amqp_method_number_t id,
+		       void *m)
+{
+    unsigned char buf[4096];
+    amqp_bytes_t enc;
+    int n;
+
+    put32(buf, id);
+    enc.bytes = buf + 4;
+    enc.len = sizeof(buf) - 4;
+
+    if ((n = amqp_encode_method(id, m, enc)) < 0) {
+	fprintf(stderr, "stubbroker: unable to encode method %08x\n", id);
+	return;
+    }
+
+    out_frame(cp, AMQP_FRAME_METHOD, chan, buf, n + 4);
+}
+
+
+/* Caller must hold cp->mutex */
+static void out_content(stub_conn_t * cp, int chan, amqp_bytes_t props,
+			amqp_bytes_t body)
+{
+    unsigned char *hdr;
+    size_t max = cp->frame_max - 8;
+    size_t off;
+    size_t len;
+
+    hdr = xmalloc(props.len + 12);
+    put16(hdr, AMQP_BASIC_CLASS);
+    put16(hdr + 2, 0);
+    put64(hdr + 4, body.len);
+    memcpy(hdr + 12, props.bytes, props.len);
+    out_frame(cp, AMQP_FRAME_HEADER, chan, hdr, props.len + 12);
+    free(hdr);
+
+    for (off = 0; off < body.len; off += len) {
+	len = body.len - off < max ? body.len - off : max;
+	out_frame(cp, AMQP_FRAME_BODY, chan, (char *) body.bytes + off,
+		  len);
+    }
+}
+
+
+static void out_flush(stub_conn_t * cp)
+{
+    pthread_cond_signal(&cp->cond);
+    pthread_mutex_unlock(&cp->mutex);
+}
+
+
+static void send_method(stub_conn_t * cp, int chan,
+			amqp_method_number_t id, void *m)
+{
+    pthread_mutex_lock(&cp->mutex);
+    out_method(cp, chan, id, m);
+    out_flush(cp);
+}
+
+
+static void *stub_writer(void *arg)
+{
+    stub_conn_t *cp = (stub_conn_t *) arg;
+    char *buf = NULL;
+    size_t size = 0;
+    size_t len;
+    size_t off;
+    size_t tmpsize;
+    char *tmp;
+    ssize_t n;
+
+    pthread_mutex_lock(&cp->mutex);
+
+    while (1) {
+	while (cp->used == 0 && !cp->closing) {
+	    pthread_cond_wait(&cp->cond, &cp->mutex);
+	}
+
+	if (cp->used == 0) {
+	    break;
+	}
+
+	/* Swap buffers so that the readers can carry on appending */
+	tmp = cp->out;
+	cp->out = buf;
+	buf = tmp;
+	len = cp->used;
+	cp->used = 0;
+	tmpsize = size;
+	size = cp->size;
+	cp->size = tmpsize;
+	pthread_mutex_unlock(&cp->mutex);
+
+	for (off = 0; off < len; off += n) {
+	    if ((n = send(cp->fd, buf + off, len - off, MSG_NOSIGNAL)) <= 0) {
+		if (n < 0 && errno == EINTR) {
+		    n = 0;
+		    continue;
+		}
+
+		shutdown(cp->fd, SHUT_RDWR);
+		break;
+	    }
+	}
+
+	pthread_mutex_lock(&cp->mutex);
+    }
+
+    pthread_mutex_unlock(&cp->mutex);
+    free(buf);
+    return (NULL);
+}
+
+/* ------------------------------------------------------------------------------------------------------- */
+
+/* Broker state; everything below is called with the global lock held */
+
+static stub_queue_t *find_queue(amqp_bytes_t name)
+{
+    stub_queue_t *q;
+
+    for (q = stub.queues; q != NULL; q = q->next) {
+	if (sameb(q->name, name)) {
+	    return (q);
+	}
+    }
+
+    return (NULL);
+}
+
+
+/* Unacknowledged messages can outlive their queue */
+static int queue_alive(stub_queue_t * q)
+{
+    stub_queue_t *qp;
+
+    for (qp = stub.queues; qp != NULL && qp != q; qp = qp->next);
+    return (qp != NULL);
+}
+
+
+static stub_exch_t *find_exch(amqp_bytes_t name)
+{
+    stub_exch_t *ep;
+
+    for (ep = stub.exchs; ep != NULL; ep = ep->next) {
+	if (sameb(ep->name, name)) {
+	    return (ep);
+	}
+    }
+
+    return (NULL);
+}
+
+
+static stub_exch_t *add_exch(const char *name, int type)
+{
+    stub_exch_t *ep;
+
+    ep = xmalloc(sizeof(stub_exch_t));
+    ep->name = dupstr(name);
+    ep->type = type;
+    ep->next = stub.exchs;
+    stub.exchs = ep;
+    return (ep);
+}
+
+
+static void deliver(stub_cons_t * sp, stub_msg_t * mp)
+{
+    stub_chan_t *cp = sp->cp;
+    amqp_basic_deliver_t m;
+    stub_unack_t *up;
+
+    m.consumer_tag = sp->tag;
+    m.delivery_tag = ++cp->tag;
+    m.redelivered = mp->redelivered;
+    m.exchange = mp->exchange;
+    m.routing_key = mp->rkey;
+
+    pthread_mutex_lock(&cp->cp->mutex);
+    out_method(cp->cp, cp->id, AMQP_BASIC_DELIVER_METHOD, &m);
+    out_content(cp->cp, cp->id, mp->props, mp->body);
+    out_flush(cp->cp);
+
+    if (sp->no_ack) {
+	msg_free(mp);
+	return;
+    }
+
+    up = xmalloc(sizeof(stub_unack_t));
+    up->next = NULL;
+    up->tag = cp->tag;
+    up->mp = mp;
+    up->q = sp->q;
+
+    if (cp->tail != NULL) {
+	cp->tail->next = up;
+    } else {
+	cp->head = up;
+    }
+
+    cp->tail = up;
+    cp->unacked++;
+}
+
+
+/* Hands queued messages to consumers with prefetch room, round-robin */
+static void dispatch(stub_queue_t * q)
+{
+    stub_cons_t *sp;
+    stub_cons_t **spp;
+    stub_msg_t *mp;
+
+    while (q->head != NULL && q->cons != NULL) {
+	for (spp = &q->cons; *spp != NULL; spp = &(*spp)->next) {
+	    sp = *spp;
+
+	    if (sp->no_ack || sp->cp->prefetch == 0
+		|| sp->cp->unacked < sp->cp->prefetch) {
+		break;
+	    }
+	}
+
+	if (*spp == NULL) {
+	    return;		/* Everyone is full */
+	}
+
+	/* Move the chosen consumer to the back of the line */
+	*spp = sp->next;
+	sp->next = NULL;
+
+	for (spp = &q->cons; *spp != NULL; spp = &(*spp)->next);
+	*spp = sp;
+
+	mp = q->head;
+	q->head = mp->next;
+	if (q->head == NULL) {
+	    q->tail = NULL;
+	}
+	q->count--;
+
+	mp->next = NULL;
+	deliver(sp, mp);
+    }
+}
+
+
+static void dispatch_all(void)
+{
+    stub_queue_t *q;
+
+    for (q = stub.queues; q != NULL; q = q->next) {
+	dispatch(q);
+    }
+}
+
+
+static void enqueue(stub_queue_t * q, stub_msg_t * mp, int front)
+{
+    if (front) {
+	mp->next = q->head;
+	q->head = mp;
+	if (q->tail == NULL) {
+	    q->tail = mp;
+	}
+    } else {
+	mp->next = NULL;
+	if (q->tail != NULL) {
+	    q->tail->next = mp;
+	} else {
+	    q->head = mp;
+	}
+	q->tail = mp;
+    }
+
+    q->count++;
+}
+
+
+static stub_msg_t *copy_msg(stub_msg_t * mp)
+{
+    stub_msg_t *np;
+
+    np = xmalloc(sizeof(stub_msg_t));
+    np->next = NULL;
+    np->exchange = dupbytes(mp->exchange);
+    np->rkey = dupbytes(mp->rkey);
+    np->props = dupbytes(mp->props);
+    np->body = dupbytes(mp->body);
+    np->redelivered = 0;
+    return (np);
+}
+
+
+static int topic_match(amqp_bytes_t pattern, amqp_bytes_t rkey)
+{
+    return (samestr(pattern, "#") || sameb(pattern, rkey));
+}
+
+
+/* Delivers to a direct reply-to address; returns 0 if there is no such consumer */
+static int route_reply(stub_msg_t * mp)
+{
+    stub_conn_t *cp;
+    stub_cons_t sc;
+
+    for (cp = stub.conns; cp != NULL; cp = cp->next) {
+	if (cp->reply_cp != NULL && samestr(mp->rkey, cp->reply)) {
+	    sc.next = NULL;
+	    sc.q = NULL;
+	    sc.cp = cp->reply_cp;
+	    sc.tag = cp->reply_tag;
+	    sc.no_ack = 1;
+	    deliver(&sc, mp);
+	    return (1);
+	}
+    }
+
+    return (0);
+}
+
+
+/* Routes a message, taking ownership of it */
+static void route(stub_msg_t * mp)
+{
+    stub_exch_t *ep;
+    stub_bind_t *bp;
+    stub_queue_t *q;
+    stub_queue_t *last = NULL;
+
+    if (mp->exchange.len == 0) {
+	if (mp->rkey.len > strlen(STUB_REPLY_TO)
+	    && memcmp(mp->rkey.bytes, STUB_REPLY_TO,
+		      strlen(STUB_REPLY_TO)) == 0) {
+	    if (!route_reply(mp)) {
+		msg_free(mp);
+	    }
+	    return;
+	}
+
+	if ((q = find_queue(mp->rkey)) != NULL) {
+	    enqueue(q, mp, 0);
+	    dispatch(q);
+	} else {
+	    msg_free(mp);
+	}
+	return;
+    }
+
+    if ((ep = find_exch(mp->exchange)) == NULL) {
+	msg_free(mp);
+	return;
+    }
+
+    /*
+     * Each bound queue gets one copy however many of its bindings match (so
+     * each is marked as it is picked); the original goes to the last one.
+     */
+    stub.routes++;
+
+    for (bp = stub.binds; bp != NULL; bp = bp->next) {
+	if (!sameb(bp->exchange, ep->name) || bp->q->routed == stub.routes) {
+	    continue;
+	}
+
+	if (ep->type == STUB_FANOUT
+	    || (ep->type == STUB_TOPIC && topic_match(bp->rkey, mp->rkey))
+	    || (ep->type == STUB_DIRECT && sameb(bp->rkey, mp->rkey))) {
+	    bp->q->routed = stub.routes;
+
+	    if (last != NULL) {
+		enqueue(last, copy_msg(mp), 0);
+		dispatch(last);
+	    }
+	    last = bp->q;
+	}
+    }
+
+    if (last != NULL) {
+	enqueue(last, mp, 0);
+	dispatch(last);
+    } else {
+	msg_free(mp);
+    }
+}
+
+
+/* Returns unacknowledged messages on a channel to the front of their queues */
+static void requeue_chan(stub_chan_t * cp)
+{
+    stub_unack_t *up;
+    stub_unack_t *rev = NULL;
+
+    /* Reverse so that pushing each to the front keeps the original order */
+    while ((up = cp->head) != NULL) {
+	cp->head = up->next;
+	up->next = rev;
+	rev = up;
+    }
+
+    while ((up = rev) != NULL) {
+	rev = up->next;
+
+	if (queue_alive(up->q)) {
+	    up->mp->redelivered = 1;
+	    enqueue(up->q, up->mp, 1);
+	} else {
+	    msg_free(up->mp);
+	}
+
+	free(up);
+    }
+
+    cp->tail = NULL;
+    cp->unacked = 0;
+}
+
+
+static void drop_consumers(stub_chan_t * cp, amqp_bytes_t * tag)
+{
+    stub_queue_t *q;
+    stub_cons_t **spp;
+    stub_cons_t *sp;
+
+    for (q = stub.queues; q != NULL; q = q->next) {
+	for (spp = &q->cons; (sp = *spp) != NULL;) {
+	    if (sp->cp == cp && (tag == NULL || sameb(sp->tag, *tag))) {
+		*spp = sp->next;
+		free(sp->tag.bytes);
+		free(sp);
+	    } else {
+		spp = &sp->next;
+	    }
+	}
+    }
+
+    if (cp->cp->reply_cp == cp
+	&& (tag == NULL || sameb(cp->cp->reply_tag, *tag))) {
+	cp->cp->reply_cp = NULL;
+	free(cp->cp->reply_tag.bytes);
+	cp->cp->reply_tag.bytes = NULL;
+    }
+}
+
+
+static void close_chan(stub_chan_t * cp)
+{
+    drop_consumers(cp, NULL);
+    requeue_chan(cp);
+    free(cp->exchange.bytes);
+    free(cp->rkey.bytes);
+    free(cp->props.bytes);
+    free(cp->body);
+    memset(&cp->exchange, '\0', sizeof(cp->exchange));
+    memset(&cp->rkey, '\0', sizeof(cp->rkey));
+    memset(&cp->props, '\0', sizeof(cp->props));
+    cp->body = NULL;
+    cp->state = STUB_IDLE;
+    cp->open = 0;
+    cp->confirm = 0;
+    cp->prefetch = 0;
+    cp->tag = 0;
+    cp->seq = 0;
+}
+
+
+static uint32_t delete_queue(stub_queue_t * q)
+{
+    stub_queue_t **qpp;
+    stub_bind_t **bpp;
+    stub_bind_t *bp;
+    stub_cons_t *sp;
+    stub_msg_t *mp;
+    uint32_t count = q->count;
+
+    for (qpp = &stub.queues; *qpp != q; qpp = &(*qpp)->next);
+    *qpp = q->next;
+
+    for (bpp = &stub.binds; (bp = *bpp) != NULL;) {
+	if (bp->q == q) {
+	    *bpp = bp->next;
+	    free(bp->exchange.bytes);
+	    free(bp->rkey.bytes);
+	    free(bp);
+	} else {
+	    bpp = &bp->next;
+	}
+    }
+
+    while ((sp = q->cons) != NULL) {
+	q->cons = sp->next;
+	free(sp->tag.bytes);
+	free(sp);
+    }
+
+    while ((mp = q->head) != NULL) {
+	q->head = mp->next;
+	msg_free(mp);
+    }
+
+    /* Unacknowledged messages from this queue are dropped when settled */
+    free(q->name.bytes);
+    free(q);
+    return (count);
+}
+
+/* ------------------------------------------------------------------------------------------------------- */
+
+static void chan_error(stub_chan_t * cp, int code, const char *text,
+		       amqp_method_number_t id)
+{
+    amqp_channel_close_t m;
+
+    m.reply_code = code;
+    m.reply_text = amqp_cstring_bytes((char *) text);
+    m.class_id = id >> 16;
+    m.method_id = id & 0xFFFF;
+    send_method(cp->cp, cp->id, AMQP_CHANNEL_CLOSE_METHOD, &m);
+
+    STUB_LOCK();
+    close_chan(cp);
+    dispatch_all();
+    STUB_UNLOCK();
+}
+
+
+static void settle(stub_chan_t * cp, uint64_t tag, int multiple, int nack,
+		   int requeue)
+{
+    stub_unack_t **upp;
+    stub_unack_t *up;
+
+    if (multiple && tag == 0) {
+	tag = cp->tag;
+    }
+
+    for (upp = &cp->head; (up = *upp) != NULL;) {
+	if (up->tag > tag) {
+	    break;
+	}
+
+	if (up->tag != tag && !multiple) {
+	    upp = &up->next;
+	    continue;
+	}
+
+	*upp = up->next;
+	cp->unacked--;
+
+	if (nack && requeue && queue_alive(up->q)) {
+	    up->mp->redelivered = 1;
+	    enqueue(up->q, up->mp, 1);
+	} else {
+	    msg_free(up->mp);
+	}
+
+	free(up);
+    }
+
+    cp->tail = NULL;
+    for (up = cp->head; up != NULL; up = up->next) {
+	cp->tail = up;
+    }
+
+    dispatch_all();
+}
+
+
+/* A complete message has arrived on a channel */
+static void published(stub_chan_t * cp)
+{
+    stub_msg_t *mp;
+    amqp_basic_ack_t m;
+
+    mp = xmalloc(sizeof(stub_msg_t));
+    mp->next = NULL;
+    mp->exchange = cp->exchange;
+    mp->rkey = cp->rkey;
+    mp->props = cp->props;
+    mp->body.bytes = cp->body;
+    mp->body.len = cp->size;
+    mp->redelivered = 0;
+
+    memset(&cp->exchange, '\0', sizeof(cp->exchange));
+    memset(&cp->rkey, '\0', sizeof(cp->rkey));
+    memset(&cp->props, '\0', sizeof(cp->props));
+    cp->body = NULL;
+    cp->state = STUB_IDLE;
+
+    STUB_LOCK();
+    route(mp);
+    STUB_UNLOCK();
+
+    if (cp->confirm) {
+	m.delivery_tag = ++cp->seq;
+	m.multiple = 0;
+	send_method(cp->cp, cp->id, AMQP_BASIC_ACK_METHOD, &m);
+    }
+}
+
+
+/*
+ * Content header: re-encode the properties (rewriting a direct reply-to
+ * address, and redirecting echo requests) and get ready for the body.
+ */
+static void header(stub_chan_t * cp, amqp_frame_t * fp)
+{
+    amqp_basic_properties_t *pp =
+	(amqp_basic_properties_t *) fp->payload.properties.decoded;
+    amqp_bytes_t enc;
+    int n;
+
+    if (pp->_flags & AMQP_BASIC_REPLY_TO_FLAG
+	&& samestr(pp->reply_to, STUB_REPLY_TO)) {
+	if (cp->cp->reply_cp != NULL) {
+	    pp->reply_to = amqp_cstring_bytes(cp->cp->reply);
+	}
+    }
+
+    if (cp->exchange.len == 0 && samestr(cp->rkey, STUB_ECHO)) {
+	free(cp->rkey.bytes);
+	if (pp->_flags & AMQP_BASIC_REPLY_TO_FLAG) {
+	    cp->rkey = dupbytes(pp->reply_to);
+	} else {
+	    cp->rkey = dupstr("");	/* Goes nowhere */
+	}
+    }
+
+    enc.bytes = cp->cp->scratch;
+    enc.len = cp->cp->frame_max;
+
+    if ((n = amqp_encode_properties(AMQP_BASIC_CLASS, pp, enc)) < 0) {
+	n = 0;
+    }
+
+    enc.len = n;
+    cp->props = dupbytes(enc);
+    cp->size = fp->payload.properties.body_size;
+    cp->got = 0;
+    cp->body = xmalloc(cp->size);
+    cp->state = STUB_BODY;
+
+    if (cp->size == 0) {
+	published(cp);
+    }
+}
+
+
+static void body(stub_chan_t * cp, amqp_frame_t * fp)
+{
+    amqp_bytes_t *bp = &fp->payload.body_fragment;
+
+    if (cp->got + bp->len > cp->size) {
+	chan_error(cp, AMQP_FRAME_ERROR, "FRAME_ERROR - body too long", 0);
+	return;
+    }
+
+    memcpy(cp->body + cp->got, bp->bytes, bp->len);
+    cp->got += bp->len;
+
+    if (cp->got == cp->size) {
+	published(cp);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------- */
+
+static int exch_type(amqp_bytes_t type)
+{
+    if (samestr(type, "fanout")) {
+	return (STUB_FANOUT);
+    }
+
+    if (samestr(type, "topic")) {
+	return (STUB_TOPIC);
+    }
+
+    return (STUB_DIRECT);
+}
+
+
+static void consume(stub_chan_t * cp, amqp_basic_consume_t * mp)
+{
+    amqp_basic_consume_ok_t ok;
+    stub_cons_t *sp;
+    stub_cons_t **spp;
+    stub_queue_t *q;
+    amqp_bytes_t tag;
+    char tmp[64];
+
+    if (mp->consumer_tag.len == 0) {
+	STUB_LOCK();
+	sprintf(tmp, "amq.ctag-%d", ++stub.ids);
+	STUB_UNLOCK();
+	tag = dupstr(tmp);
+    } else {
+	tag = dupbytes(mp->consumer_tag);
+    }
+
+    ok.consumer_tag = tag;
+
+    STUB_LOCK();
+
+    if (samestr(mp->queue, STUB_REPLY_TO)) {
+	if (!mp->no_ack || cp->cp->reply_cp != NULL) {
+	    STUB_UNLOCK();
+	    free(tag.bytes);
+	    chan_error(cp, AMQP_PRECONDITION_FAILED,
+		       "PRECONDITION_FAILED - reply consumer must be no-ack and unique",
+		       AMQP_BASIC_CONSUME_METHOD);
+	    return;
+	}
+
+	cp->cp->reply_cp = cp;
+	cp->cp->reply_tag = tag;
+	STUB_UNLOCK();
+
+	if (!mp->nowait) {
+	    send_method(cp->cp, cp->id, AMQP_BASIC_CONSUME_OK_METHOD, &ok);
+	}
+	return;
+    }
+
+    if ((q = find_queue(mp->queue)) == NULL) {
+	STUB_UNLOCK();
+	free(tag.bytes);
+	chan_error(cp, AMQP_NOT_FOUND, "NOT_FOUND - no queue",
+		   AMQP_BASIC_CONSUME_METHOD);
+	return;
+    }
+
+    sp = xmalloc(sizeof(stub_cons_t));
+    sp->next = NULL;
+    sp->q = q;
+    sp->cp = cp;
+    sp->tag = tag;
+    sp->no_ack = mp->no_ack;
+
+    for (spp = &q->cons; *spp != NULL; spp = &(*spp)->next);
+    *spp = sp;
+
+    /* consume-ok must reach the client ahead of the first delivery */
+    if (!mp->nowait) {
+	send_method(cp->cp, cp->id, AMQP_BASIC_CONSUME_OK_METHOD, &ok);
+    }
+
+    dispatch(q);
+    STUB_UNLOCK();
+}
+
+
+static void get(stub_chan_t * cp, amqp_basic_get_t * mp)
+{
+    amqp_basic_get_ok_t ok;
+    amqp_basic_get_empty_t empty;
+    stub_queue_t *q;
+    stub_msg_t *np;
+
+    STUB_LOCK();
+
+    if ((q = find_queue(mp->queue)) == NULL) {
+	STUB_UNLOCK();
+	chan_error(cp, AMQP_NOT_FOUND, "NOT_FOUND - no queue",
+		   AMQP_BASIC_GET_METHOD);
+	return;
+    }
+
+    if ((np = q->head) == NULL) {
+	STUB_UNLOCK();
+	empty.cluster_id = amqp_empty_bytes;
+	send_method(cp->cp, cp->id, AMQP_BASIC_GET_EMPTY_METHOD, &empty);
+	return;
+    }
+
+    q->head = np->next;
+    if (q->head == NULL) {
+	q->tail = NULL;
+    }
+    q->count--;
+    np->next = NULL;
+
+    ok.delivery_tag = cp->tag + 1;
+    ok.redelivered = np->redelivered;
+    ok.exchange = np->exchange;
+    ok.routing_key = np->rkey;
+    ok.message_count = q->count;
+
+    /* Reuse the delivery bookkeeping, but with a get-ok in front */
+    pthread_mutex_lock(&cp->cp->mutex);
+    out_method(cp->cp, cp->id, AMQP_BASIC_GET_OK_METHOD, &ok);
+    out_content(cp->cp, cp->id, np->props, np->body);
+    out_flush(cp->cp);
+    cp->tag++;
+
+    if (mp->no_ack) {
+	msg_free(np);
+    } else {
+	stub_unack_t *up = xmalloc(sizeof(stub_unack_t));
+
+	up->next = NULL;
+	up->tag = cp->tag;
+	up->mp = np;
+	up->q = q;
+
+	if (cp->tail != NULL) {
+	    cp->tail->next = up;
+	} else {
+	    cp->head = up;
+	}
+	cp->tail = up;
+	cp->unacked++;
+    }
+
+    STUB_UNLOCK();
+}
+
+
+static void method(stub_chan_t * cp, amqp_method_t * mp)
+{
+    stub_conn_t *conn = cp->cp;
+    void *d = mp->decoded;
+    char dummy[8];
+    char tmp[64];
+
+    memset(dummy, '\0', sizeof(dummy));
+
+    if (!cp->open && mp->id != AMQP_CHANNEL_OPEN_METHOD) {
+	return;			/* Ignore anything after a channel close */
+    }
+
+    if (cp->state != STUB_IDLE && mp->id != AMQP_CHANNEL_CLOSE_METHOD) {
+	chan_error(cp, AMQP_UNEXPECTED_FRAME,
+		   "UNEXPECTED_FRAME - expected content", mp->id);
+	return;
+    }
+
+    switch (mp->id) {
+    case AMQP_CHANNEL_OPEN_METHOD:{
+	    amqp_channel_open_ok_t ok;
+
+	    cp->open = 1;
+	    ok.channel_id = amqp_empty_bytes;
+	    send_method(conn, cp->id, AMQP_CHANNEL_OPEN_OK_METHOD, &ok);
+	    break;
+	}
+
+    case AMQP_CHANNEL_CLOSE_METHOD:
+	STUB_LOCK();
+	close_chan(cp);
+	dispatch_all();
+	STUB_UNLOCK();
+	send_method(conn, cp->id, AMQP_CHANNEL_CLOSE_OK_METHOD, dummy);
+	break;
+
+    case AMQP_CHANNEL_CLOSE_OK_METHOD:
+	break;
+
+    case AMQP_EXCHANGE_DECLARE_METHOD:{
+	    amqp_exchange_declare_t *m = d;
+	    stub_exch_t *ep;
+
+	    STUB_LOCK();
+	    ep = find_exch(m->exchange);
+
+	    if (ep == NULL && m->passive) {
+		STUB_UNLOCK();
+		chan_error(cp, AMQP_NOT_FOUND, "NOT_FOUND - no exchange",
+			   mp->id);
+		break;
+	    }
+
+	    if (ep == NULL) {
+		ep = add_exch("", exch_type(m->type));
+		free(ep->name.bytes);
+		ep->name = dupbytes(m->exchange);
+	    }
+	    STUB_UNLOCK();
+
+	    if (!m->nowait) {
+		send_method(conn, cp->id, AMQP_EXCHANGE_DECLARE_OK_METHOD,
+			    dummy);
+	    }
+	    break;
+	}
+
+    case AMQP_EXCHANGE_DELETE_METHOD:{
+	    amqp_exchange_delete_t *m = d;
+	    stub_exch_t **epp;
+	    stub_exch_t *ep;
+	    stub_bind_t **bpp;
+	    stub_bind_t *bp;
+
+	    STUB_LOCK();
+	    for (epp = &stub.exchs; (ep = *epp) != NULL; epp = &ep->next) {
+		if (sameb(ep->name, m->exchange)) {
+		    *epp = ep->next;
+		    free(ep->name.bytes);
+		    free(ep);
+		    break;
+		}
+	    }
+
+	    for (bpp = &stub.binds; (bp = *bpp) != NULL;) {
+		if (sameb(bp->exchange, m->exchange)) {
+		    *bpp = bp->next;
+		    free(bp->exchange.bytes);
+		    free(bp->rkey.bytes);
+		    free(bp);
+		} else {
+		    bpp = &bp->next;
+		}
+	    }
+	    STUB_UNLOCK();
+
+	    if (!m->nowait) {
+		send_method(conn, cp->id, AMQP_EXCHANGE_DELETE_OK_METHOD,
+			    dummy);
+	    }
+	    break;
+	}
+
+    case AMQP_EXCHANGE_BIND_METHOD:
+	/* Accepted but exchange-to-exchange routing is not implemented */
+	if (!((amqp_exchange_bind_t *) d)->nowait) {
+	    send_method(conn, cp->id, AMQP_EXCHANGE_BIND_OK_METHOD, dummy);
+	}
+	break;
+
+    case AMQP_EXCHANGE_UNBIND_METHOD:
+	if (!((amqp_exchange_unbind_t *) d)->nowait) {
+	    send_method(conn, cp->id, AMQP_EXCHANGE_UNBIND_OK_METHOD,
+			dummy);
+	}
+	break;
+
+    case AMQP_QUEUE_DECLARE_METHOD:{
+	    amqp_queue_declare_t *m = d;
+	    amqp_queue_declare_ok_t ok;
+	    stub_queue_t *q;
+	    stub_cons_t *sp;
+
+	    STUB_LOCK();
+
+	    if (m->queue.len == 0) {
+		sprintf(tmp, "amq.gen-%d", ++stub.ids);
+		m->queue = amqp_cstring_bytes(tmp);
+	    }
+
+	    if ((q = find_queue(m->queue)) == NULL) {
+		if (m->passive) {
+		    STUB_UNLOCK();
+		    chan_error(cp, AMQP_NOT_FOUND, "NOT_FOUND - no queue",
+			       mp->id);
+		    break;
+		}
+
+		q = xmalloc(sizeof(stub_queue_t));
+		memset(q, '\0', sizeof(stub_queue_t));
+		q->name = dupbytes(m->queue);
+		q->next = stub.queues;
+		stub.queues = q;
+	    }
+
+	    ok.queue = q->name;
+	    ok.message_count = q->count;
+	    ok.consumer_count = 0;
+	    for (sp = q->cons; sp != NULL; sp = sp->next) {
+		ok.consumer_count++;
+	    }
+
+	    if (!m->nowait) {
+		send_method(conn, cp->id, AMQP_QUEUE_DECLARE_OK_METHOD, &ok);
+	    }
+	    STUB_UNLOCK();
+	    break;
+	}
+
+    case AMQP_QUEUE_BIND_METHOD:{
+	    amqp_queue_bind_t *m = d;
+	    stub_queue_t *q;
+	    stub_bind_t *bp;
+
+	    STUB_LOCK();
+
+	    if ((q = find_queue(m->queue)) == NULL
+		|| find_exch(m->exchange) == NULL) {
+		STUB_UNLOCK();
+		chan_error(cp, AMQP_NOT_FOUND,
+			   "NOT_FOUND - no queue or exchange", mp->id);
+		break;
+	    }
+
+	    for (bp = stub.binds; bp != NULL; bp = bp->next) {
+		if (bp->q == q && sameb(bp->exchange, m->exchange)
+		    && sameb(bp->rkey, m->routing_key)) {
+		    break;
+		}
+	    }
+
+	    if (bp == NULL) {
+		bp = xmalloc(sizeof(stub_bind_t));
+		bp->exchange = dupbytes(m->exchange);
+		bp->rkey = dupbytes(m->routing_key);
+		bp->q = q;
+		bp->next = stub.binds;
+		stub.binds = bp;
+	    }
+	    STUB_UNLOCK();
+
+	    if (!m->nowait) {
+		send_method(conn, cp->id, AMQP_QUEUE_BIND_OK_METHOD, dummy);
+	    }
+	    break;
+	}
+
+    case AMQP_QUEUE_UNBIND_METHOD:{
+	    amqp_queue_unbind_t *m = d;
+	    stub_bind_t **bpp;
+	    stub_bind_t *bp;
+
+	    STUB_LOCK();
+	    for (bpp = &stub.binds; (bp = *bpp) != NULL; bpp = &bp->next) {
+		if (sameb(bp->q->name, m->queue)
+		    && sameb(bp->exchange, m->exchange)
+		    && sameb(bp->rkey, m->routing_key)) {
+		    *bpp = bp->next;
+		    free(bp->exchange.bytes);
+		    free(bp->rkey.bytes);
+		    free(bp);
+		    break;
+		}
+	    }
+	    STUB_UNLOCK();
+
+	    send_method(conn, cp->id, AMQP_QUEUE_UNBIND_OK_METHOD, dummy);
+	    break;
+	}
+
+    case AMQP_QUEUE_PURGE_METHOD:{
+	    amqp_queue_purge_t *m = d;
+	    amqp_queue_purge_ok_t ok;
+	    stub_queue_t *q;
+	    stub_msg_t *np;
+
+	    ok.message_count = 0;
+
+	    STUB_LOCK();
+	    if ((q = find_queue(m->queue)) != NULL) {
+		ok.message_count = q->count;
+
+		while ((np = q->head) != NULL) {
+		    q->head = np->next;
+		    msg_free(np);
+		}
+
+		q->tail = NULL;
+		q->count = 0;
+	    }
+	    STUB_UNLOCK();
+
+	    if (!m->nowait) {
+		send_method(conn, cp->id, AMQP_QUEUE_PURGE_OK_METHOD, &ok);
+	    }
+	    break;
+	}
+
+    case AMQP_QUEUE_DELETE_METHOD:{
+	    amqp_queue_delete_t *m = d;
+	    amqp_queue_delete_ok_t ok;
+	    stub_queue_t *q;
+
+	    ok.message_count = 0;
+
+	    STUB_LOCK();
+	    if ((q = find_queue(m->queue)) != NULL) {
+		ok.message_count = delete_queue(q);
+	    }
+	    STUB_UNLOCK();
+
+	    if (!m->nowait) {
+		send_method(conn, cp->id, AMQP_QUEUE_DELETE_OK_METHOD, &ok);
+	    }
+	    break;
+	}
+
+    case AMQP_BASIC_QOS_METHOD:
+	STUB_LOCK();
+	cp->prefetch = ((amqp_basic_qos_t *) d)->prefetch_count;
+	dispatch_all();
+	STUB_UNLOCK();
+	send_method(conn, cp->id, AMQP_BASIC_QOS_OK_METHOD, dummy);
+	break;
+
+    case AMQP_BASIC_CONSUME_METHOD:
+	consume(cp, (amqp_basic_consume_t *) d);
+	break;
+
+    case AMQP_BASIC_CANCEL_METHOD:{
+	    amqp_basic_cancel_t *m = d;
+	    amqp_basic_cancel_ok_t ok;
+
+	    STUB_LOCK();
+	    drop_consumers(cp, &m->consumer_tag);
+	    STUB_UNLOCK();
+
+	    if (!m->nowait) {
+		ok.consumer_tag = m->consumer_tag;
+		send_method(conn, cp->id, AMQP_BASIC_CANCEL_OK_METHOD, &ok);
+	    }
+	    break;
+	}
+
+    case AMQP_BASIC_PUBLISH_METHOD:{
+	    amqp_basic_publish_t *m = d;
+
+	    cp->exchange = dupbytes(m->exchange);
+	    cp->rkey = dupbytes(m->routing_key);
+	    cp->state = STUB_HEADER;
+	    break;
+	}
+
+    case AMQP_BASIC_GET_METHOD:
+	get(cp, (amqp_basic_get_t *) d);
+	break;
+
+    case AMQP_BASIC_ACK_METHOD:{
+	    amqp_basic_ack_t *m = d;
+
+	    STUB_LOCK();
+	    settle(cp, m->delivery_tag, m->multiple, 0, 0);
+	    STUB_UNLOCK();
+	    break;
+	}
+
+    case AMQP_BASIC_NACK_METHOD:{
+	    amqp_basic_nack_t *m = d;
+
+	    STUB_LOCK();
+	    settle(cp, m->delivery_tag, m->multiple, 1, m->requeue);
+	    STUB_UNLOCK();
+	    break;
+	}
+
+    case AMQP_BASIC_REJECT_METHOD:{
+	    amqp_basic_reject_t *m = d;
+
+	    STUB_LOCK();
+	    settle(cp, m->delivery_tag, 0, 1, m->requeue);
+	    STUB_UNLOCK();
+	    break;
+	}
+
+    case AMQP_CONFIRM_SELECT_METHOD:
+	cp->confirm = 1;
+	if (!((amqp_confirm_select_t *) d)->nowait) {
+	    send_method(conn, cp->id, AMQP_CONFIRM_SELECT_OK_METHOD, dummy);
+	}
+	break;
+
+    case AMQP_TX_SELECT_METHOD:
+	send_method(conn, cp->id, AMQP_TX_SELECT_OK_METHOD, dummy);
+	break;
+
+    case AMQP_TX_COMMIT_METHOD:
+	send_method(conn, cp->id, AMQP_TX_COMMIT_OK_METHOD, dummy);
+	break;
+
+    case AMQP_TX_ROLLBACK_METHOD:
+	send_method(conn, cp->id, AMQP_TX_ROLLBACK_OK_METHOD, dummy);
+	break;
+
+    default:
+	chan_error(cp, AMQP_NOT_IMPLEMENTED, "NOT_IMPLEMENTED", mp->id);
+	break;
+    }
+}
+
+
+/* Connection-level (channel 0) methods; returns -1 to drop the connection */
+static int connection(stub_conn_t * cp, amqp_method_t * mp)
+{
+    char dummy[8];
+
+    memset(dummy, '\0', sizeof(dummy));
+
+    switch (mp->id) {
+    case AMQP_CONNECTION_START_OK_METHOD:{
+	    amqp_connection_tune_t m;
+
+	    m.channel_max = STUB_MAX_CHAN;
+	    m.frame_max = STUB_FRAME_MAX;
+	    m.heartbeat = 0;
+	    send_method(cp, 0, AMQP_CONNECTION_TUNE_METHOD, &m);
+	    break;
+	}
+
+    case AMQP_CONNECTION_TUNE_OK_METHOD:{
+	    amqp_connection_tune_ok_t *m = mp->decoded;
+
+	    if (m->frame_max >= AMQP_FRAME_MIN_SIZE
+		&& m->frame_max < STUB_FRAME_MAX) {
+		cp->frame_max = m->frame_max;
+	    }
+	    break;
+	}
+
+    case AMQP_CONNECTION_OPEN_METHOD:{
+	    amqp_connection_open_ok_t m;
+
+	    m.known_hosts = amqp_empty_bytes;
+	    send_method(cp, 0, AMQP_CONNECTION_OPEN_OK_METHOD, &m);
+	    break;
+	}
+
+    case AMQP_CONNECTION_CLOSE_METHOD:
+	send_method(cp, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, dummy);
+	return (-1);
+
+    case AMQP_CONNECTION_CLOSE_OK_METHOD:
+	return (-1);
+
+    default:
+	break;
+    }
+
+    return (0);
+}
+
+
+static int frame(stub_conn_t * cp, amqp_frame_t * fp)
+{
+    stub_chan_t *chp;
+
+    if (fp->frame_type == AMQP_PSEUDOFRAME_PROTOCOL_HEADER) {
+	amqp_connection_start_t m;
+
+	m.version_major = 0;
+	m.version_minor = 9;
+	m.server_properties = amqp_empty_table;
+	m.mechanisms = amqp_cstring_bytes("PLAIN");
+	m.locales = amqp_cstring_bytes("en_US");
+	send_method(cp, 0, AMQP_CONNECTION_START_METHOD, &m);
+	return (0);
+    }
+
+    if (fp->frame_type == AMQP_FRAME_HEARTBEAT) {
+	return (0);
+    }
+
+    if (fp->channel == 0) {
+	if (fp->frame_type == AMQP_FRAME_METHOD) {
+	    return (connection(cp, &fp->payload.method));
+	}
+	return (0);
+    }
+
+    if (fp->channel > STUB_MAX_CHAN) {
+	return (-1);
+    }
+
+    chp = &cp->chans[fp->channel];
+
+    switch (fp->frame_type) {
+    case AMQP_FRAME_METHOD:
+	method(chp, &fp->payload.method);
+	break;
+
+    case AMQP_FRAME_HEADER:
+	if (chp->state != STUB_HEADER) {
+	    chan_error(chp, AMQP_UNEXPECTED_FRAME,
+		       "UNEXPECTED_FRAME - unexpected content header", 0);
+	    break;
+	}
+	header(chp, fp);
+	break;
+
+    case AMQP_FRAME_BODY:
+	if (chp->state != STUB_BODY) {
+	    chan_error(chp, AMQP_UNEXPECTED_FRAME,
+		       "UNEXPECTED_FRAME - unexpected content body", 0);
+	    break;
+	}
+	body(chp, fp);
+	break;
+
+    default:
+	break;
+    }
+
+    return (0);
+}
+
+/* ------------------------------------------------------------------------------------------------------- */
+
+static void *stub_reader(void *arg)
+{
+    stub_conn_t *cp = (stub_conn_t *) arg;
+    stub_conn_t **cpp;
+    amqp_frame_t f;
+    amqp_bytes_t in;
+    char buf[65536];
+    ssize_t n;
+    size_t off;
+    int rv;
+    int i;
+
+    while ((n = recv(cp->fd, buf, sizeof(buf), 0)) > 0
+	   || (n < 0 && errno == EINTR)) {
+	for (off = 0; n > 0 && off < (size_t) n; off += rv) {
+	    in.bytes = buf + off;
+	    in.len = n - off;
+
+	    if ((rv = amqp_handle_input(cp->state, in, &f)) < 0) {
+		fprintf(stderr, "stubbroker: %s\n", amqp_error_string2(rv));
+		goto done;
+	    }
+
+	    if (f.frame_type != 0 && frame(cp, &f) == -1) {
+		goto done;
+	    }
+	}
+
+	amqp_maybe_release_buffers(cp->state);
+    }
+
+  done:
+    STUB_LOCK();
+    for (i = 1; i <= STUB_MAX_CHAN; i++) {
+	close_chan(&cp->chans[i]);
+    }
+
+    for (cpp = &stub.conns; *cpp != cp; cpp = &(*cpp)->next);
+    *cpp = cp->next;
+    dispatch_all();
+    STUB_UNLOCK();
+
+    pthread_mutex_lock(&cp->mutex);
+    cp->closing = 1;
+    out_flush(cp);
+    pthread_join(cp->writer, NULL);
+
+    close(cp->fd);
+    amqp_destroy_connection(cp->state);
+    pthread_mutex_destroy(&cp->mutex);
+    pthread_cond_destroy(&cp->cond);
+    free(cp->out);
+    free(cp->scratch);
+    free(cp);
+    return (NULL);
+}
+
+
+static void stub_accept(int fd)
+{
+    stub_conn_t *cp;
+    pthread_t tid;
+    int one = 1;
+    int i;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    cp = xmalloc(sizeof(stub_conn_t));
+    memset(cp, '\0', sizeof(stub_conn_t));
+    cp->fd = fd;
+    cp->frame_max = STUB_FRAME_MAX;
+    cp->scratch = xmalloc(STUB_FRAME_MAX);
+    pthread_mutex_init(&cp->mutex, NULL);
+    pthread_cond_init(&cp->cond, NULL);
+
+    for (i = 0; i <= STUB_MAX_CHAN; i++) {
+	cp->chans[i].cp = cp;
+	cp->chans[i].id = i;
+    }
+
+    /* The decoder's inbound limit starts at 64K; allow for our frame_max */
+    if ((cp->state = amqp_new_connection()) == NULL
+	|| amqp_tune_connection(cp->state, 0, STUB_FRAME_MAX, 0) != 0) {
+	fprintf(stderr, "stubbroker: unable to create decoder\n");
+	abort();
+    }
+
+    STUB_LOCK();
+    cp->id = ++stub.ids;
+    sprintf(cp->reply, "%s.%d", STUB_REPLY_TO, cp->id);
+    cp->next = stub.conns;
+    stub.conns = cp;
+    STUB_UNLOCK();
+
+    pthread_create(&cp->writer, NULL, stub_writer, cp);
+
+    if (pthread_create(&tid, NULL, stub_reader, cp) == 0) {
+	pthread_detach(tid);
+    }
+}
+
+
+static void *stub_listen(void *arg)
+{
+    int fd;
+
+    (void) arg;
+
+    while (1) {
+	if ((fd = accept(stub.lfd, NULL, NULL)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED) {
+		continue;
+	    }
+	    perror("stubbroker: accept");
+	    break;
+	}
+
+	stub_accept(fd);
+    }
+
+    return (NULL);
+}
+
+
+/*
+ * Starts the broker on the loopback interface in a background thread. Port 0
+ * picks a free port. Returns the port being listened on, or -1 on error.
+ */
+int RMQ_stub_start(int port)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    pthread_t tid;
+    int one = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    STUB_LOCK();
+    if (stub.exchs == NULL) {
+	add_exch("amq.direct", STUB_DIRECT);
+	add_exch("amq.fanout", STUB_FANOUT);
+	add_exch("amq.topic", STUB_TOPIC);
+    }
+    STUB_UNLOCK();
+
+    if ((stub.lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	perror("stubbroker: socket");
+	return (-1);
+    }
+
+    setsockopt(stub.lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&sa, '\0', sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(stub.lfd, (struct sockaddr *) &sa, sizeof(sa)) < 0
+	|| listen(stub.lfd, 64) < 0
+	|| getsockname(stub.lfd, (struct sockaddr *) &sa, &len) < 0) {
+	perror("stubbroker: bind");
+	close(stub.lfd);
+	stub.lfd = -1;
+	return (-1);
+    }
+
+    if (pthread_create(&tid, NULL, stub_listen, NULL) != 0) {
+	close(stub.lfd);
+	stub.lfd = -1;
+	return (-1);
+    }
+
+    pthread_detach(tid);
+    return (ntohs(sa.sin_port));
+}
+
+
+#ifndef RMQ_STUB_EMBED
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: stubbroker [-p port]\n");
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int port = STUB_PORT;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:")) != -1) {
+	switch (c) {
+	case 'p':
+	    port = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+
+    if ((port = RMQ_stub_start(port)) < 0) {
+	return (1);
+    }
+
+    fprintf(stderr, "stubbroker: listening on 127.0.0.1:%d\n", port);
+
+    while (1) {
+	pause();
+    }
+
+    return (0);
+}
+
+#endif				/* RMQ_STUB_EMBED */